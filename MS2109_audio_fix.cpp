@@ -0,0 +1,584 @@
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#ifdef _WIN32
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <errno.h>
+#include <unistd.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HAVE_SSE2
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#define HAVE_AVX2
+#endif
+
+/* compile from the command line:
+*  "cl /O2 MS2109_audio_fix.cpp" (add /arch:AVX2 for the AVX2 kernel)
+*  or "g++ -O2 -pthread MS2109_audio_fix.cpp" (add -mavx2 or -march=native for the AVX2 kernel)
+*
+*  Filters the audio from a patched MS2109: reads interleaved 16-bit 48000Hz stereo PCM
+*  (e.g. from "arecord -f S16_LE -r 48000 -c 2 -t raw") and writes it back out with the
+*  channels the right way round.
+*  Unpatched devices work too: capture them as 96000Hz mono ("-r 96000 -c 1"), which is really
+*  the same 48000Hz stereo, and the output is 48000Hz stereo. Raw PCM or WAV (with the header
+*  relabelled to match) both work.
+*
+*  The MS2109 emits one stray sample before the first real one, so every frame the host sees
+*  is the left sample of one real frame preceded by the right sample of the one before:
+*   device:  stray L0 | R0 L1 | R1 L2 | ...
+*  which is where the swapped, one-sample-out-of-phase stereo comes from. Dropping the stray
+*  sample fixes both at once, and in a stream that's the same as delaying the whole thing by
+*  one sample (and silencing the first one):
+*   fixed:   0 0 | L0 R0 | L1 R1 | ...
+*  So the filter holds back the last sample of every buffer to start the next one with, adding
+*  exactly one frame of latency.
+*/
+
+#define SAMPLE_RATE 48000
+#define MAX_WAV_CHUNK 0x10000 // largest chunk before the audio that gets copied through
+
+/* out[i] = in[i-1], with carry standing in for in[-1]. Returns the last input sample, which
+*  is the carry for the next buffer. Reads each block before writing it, so out may equal in.
+*/
+static int16_t delay_one_sample_scalar(const int16_t* in, int16_t* out, size_t n, int16_t carry) {
+  for (size_t i = 0; i < n; i++) {
+    int16_t s = in[i];
+    out[i] = carry;
+    carry = s;
+  }
+  return carry;
+}
+
+static int16_t delay_one_sample(const int16_t* in, int16_t* out, size_t n, int16_t carry) {
+  size_t i = 0;
+#if defined(HAVE_AVX2)
+  if (n >= 16) {
+    // the carry goes in the top sample of "prev", which is all alignr looks at
+    __m256i prev = _mm256_insert_epi16(_mm256_setzero_si256(), carry, 15);
+    for (; i + 16 <= n; i += 16) {
+      __m256i v = _mm256_loadu_si256((const __m256i*)(in + i));
+      // alignr works within 128-bit lanes, so first line up [prev.hi, v.lo] against [v.lo, v.hi]
+      __m256i t = _mm256_permute2x128_si256(prev, v, 0x21);
+      _mm256_storeu_si256((__m256i*)(out + i), _mm256_alignr_epi8(v, t, 14));
+      prev = v;
+    }
+    carry = (int16_t)_mm256_extract_epi16(prev, 15);
+  }
+#elif defined(HAVE_SSE2)
+  if (n >= 8) {
+    __m128i prev = _mm_insert_epi16(_mm_setzero_si128(), carry, 7);
+    for (; i + 8 <= n; i += 8) {
+      __m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+      _mm_storeu_si128((__m128i*)(out + i), _mm_or_si128(_mm_slli_si128(v, 2), _mm_srli_si128(prev, 14)));
+      prev = v;
+    }
+    carry = (int16_t)_mm_extract_epi16(prev, 7);
+  }
+#endif
+  return delay_one_sample_scalar(in + i, out + i, n - i, carry);
+}
+
+static const char* kernel_name(void) {
+#if defined(HAVE_AVX2)
+  return "AVX2";
+#elif defined(HAVE_SSE2)
+  return "SSE2";
+#else
+  return "scalar";
+#endif
+}
+
+/* Streaming state for one capture stream; buffers can be any number of whole frames and
+*  the output always has as many frames as the input.
+*/
+class stereo_fix {
+public:
+  stereo_fix() { reset(); }
+
+  // call when the device starts streaming again, since there's a new stray sample at the start
+  void reset(void) {
+    carry = 0;
+    started = false;
+  }
+
+  void process(const int16_t* in, int16_t* out, size_t frames) {
+    if (frames == 0) return;
+    carry = delay_one_sample(in, out, frames * 2, carry);
+    if (!started) {
+      // the stray sample is now the right half of the first frame
+      out[1] = 0;
+      started = true;
+    }
+  }
+
+  void process(int16_t* buf, size_t frames) { process(buf, buf, frames); }
+
+private:
+  int16_t carry;
+  bool started;
+};
+
+/* What the device would send for a test signal where L[i] = i * 3 and R[i] = -i */
+static std::vector<int16_t> make_test_stream(size_t frames) {
+  std::vector<int16_t> s(frames * 2);
+  s[0] = 0x5A5A; // stray
+  for (size_t i = 1; i < s.size(); i++) {
+    size_t frame = (i - 1) / 2;
+    s[i] = (i - 1) & 1 ? (int16_t)(0 - frame) : (int16_t)(frame * 3);
+  }
+  return s;
+}
+
+static bool check_test_stream(const std::vector<int16_t>& s) {
+  if (s[0] != 0 || s[1] != 0) {
+    fprintf(stderr, "First frame should be silent, got %d %d\n", s[0], s[1]);
+    return false;
+  }
+  for (size_t i = 1; i < s.size() / 2; i++) {
+    int16_t l = (int16_t)((i - 1) * 3), r = (int16_t)(0 - (i - 1));
+    if (s[i * 2] != l || s[i * 2 + 1] != r) {
+      fprintf(stderr, "Frame %u is %d %d, expected %d %d\n", (unsigned)i, s[i * 2], s[i * 2 + 1], l, r);
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Checks the output against the expected signal for a few buffer sizes (including ones that
+*  leave a scalar tail), then times the kernel in place over a minute of audio.
+*/
+static int benchmark(size_t buffer_frames) {
+  const size_t frames = SAMPLE_RATE * 60;
+  const std::vector<int16_t> stream = make_test_stream(frames);
+
+  const size_t sizes[] = { 1, 7, 13, 480, buffer_frames };
+  for (size_t size : sizes) {
+    std::vector<int16_t> s = stream;
+    stereo_fix fix;
+    for (size_t f = 0; f < frames; f += size)
+      fix.process(&s[f * 2], std::min(size, frames - f));
+    if (!check_test_stream(s)) {
+      fprintf(stderr, "Output is wrong with %u frame buffers!\n", (unsigned)size);
+      return -1;
+    }
+  }
+
+  std::vector<int16_t> s = stream;
+  stereo_fix fix;
+  unsigned passes = 0;
+  auto start = std::chrono::steady_clock::now();
+  double elapsed;
+  do {
+    for (size_t f = 0; f < frames; f += buffer_frames)
+      fix.process(&s[f * 2], std::min(buffer_frames, frames - f));
+    passes++;
+    elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  } while (elapsed < 1.0);
+
+  double audio_seconds = (double)passes * frames / SAMPLE_RATE;
+  fprintf(stderr, "%s kernel, %u frame buffers: %.0f seconds of audio in %.3f seconds, %.0fx realtime\n",
+    kernel_name(), (unsigned)buffer_frames, audio_seconds, elapsed, audio_seconds / elapsed);
+  return 0;
+}
+
+/* One buffer's worth of audio on its way through the pipeline */
+struct audio_buffer {
+  int16_t* samples;
+  size_t frames;
+  bool end; // nothing after this one, the input is finished (or failed)
+  std::chrono::steady_clock::time_point captured, fixed;
+};
+
+/* A fixed ring of buffers handed along capture -> fix -> sink. Each stage advances its own
+*  cursor and only waits on the stage before it (capture waits on the sink to hand buffers
+*  back), so there are no locks, and the samples never move: they're read straight into the
+*  ring, corrected in place and written out from the same memory. Nothing is allocated once
+*  the pipeline is running.
+*/
+class buffer_ring {
+public:
+  buffer_ring(size_t count, size_t frames) : buffer_frames(frames), buffers(count), storage(count * frames * 2) {
+    for (size_t i = 0; i < count; i++)
+      buffers[i].samples = &storage[i * frames * 2];
+  }
+
+  audio_buffer& at(size_t seq) { return buffers[seq % buffers.size()]; }
+  size_t size(void) const { return buffers.size(); }
+
+  /* Waits for a stage's cursor to reach seq. Spins briefly since the next buffer usually isn't
+  *  far off, then sleeps in short steps, which still comes in well under a buffer period.
+  *  Returns false if another stage gave up.
+  */
+  bool wait_for(const std::atomic<size_t>& cursor, size_t seq) const {
+    for (unsigned spins = 0; cursor.load(std::memory_order_acquire) < seq; spins++) {
+      if (failed.load(std::memory_order_relaxed))
+        return false;
+      if (spins < 1000)
+        std::this_thread::yield();
+      else
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    return true;
+  }
+
+  std::atomic<size_t> captured{0}, fixed{0}, written{0};
+  std::atomic<bool> failed{false};
+  std::atomic<bool> read_error{false}; // the input ended on an error rather than EOF
+  const size_t buffer_frames;
+
+private:
+  std::vector<audio_buffer> buffers;
+  std::vector<int16_t> storage;
+};
+
+static int open_fd(const char* filename, bool create) {
+#ifdef _WIN32
+  return create ? _open(filename, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE) : _open(filename, _O_RDONLY | _O_BINARY);
+#else
+  return create ? open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644) : open(filename, O_RDONLY);
+#endif
+}
+
+static bool close_fd(int fd) {
+#ifdef _WIN32
+  return _close(fd) == 0;
+#else
+  return close(fd) == 0;
+#endif
+}
+
+static long read_fd(int fd, void* buf, size_t len) {
+#ifdef _WIN32
+  return _read(fd, buf, (unsigned)len);
+#else
+  long ret;
+  while ((ret = (long)read(fd, buf, len)) < 0 && errno == EINTR);
+  return ret;
+#endif
+}
+
+static bool write_fd(int fd, const void* buf, size_t len) {
+  const uint8_t* p = (const uint8_t*)buf;
+  while (len) {
+#ifdef _WIN32
+    long ret = _write(fd, p, (unsigned)len);
+#else
+    long ret = (long)write(fd, p, len);
+    if (ret < 0 && errno == EINTR) continue;
+#endif
+    if (ret <= 0) return false;
+    p += ret;
+    len -= ret;
+  }
+  return true;
+}
+
+/* Where the capture stage reads from. Reading the WAV header can leave it holding the first
+*  few bytes of audio, and a WAV file's data chunk may be followed by other chunks.
+*/
+struct capture_source {
+  int fd;
+  uint8_t partial[4];
+  size_t partial_len = 0; // bytes of a frame left over from the last read
+  unsigned long long remaining = ~0ULL;
+};
+
+/* Passes on whatever a read returns straight away rather than waiting to fill the buffer, so
+*  a buffer never sits in this stage for longer than it took to arrive. Holds its own
+*  reference to the ring since it may be left blocked in a read after the rest have finished.
+*/
+static void capture_stage(std::shared_ptr<buffer_ring> ring_ref, capture_source src) {
+  buffer_ring& ring = *ring_ref;
+  for (size_t seq = 0; ; seq++) {
+    if (seq >= ring.size() && !ring.wait_for(ring.written, seq - ring.size() + 1))
+      return;
+    audio_buffer& buf = ring.at(seq);
+    uint8_t* p = (uint8_t*)buf.samples;
+    memcpy(p, src.partial, src.partial_len);
+    size_t total = src.partial_len;
+    long len = 1;
+    while (total < 4) {
+      size_t want = (size_t)std::min<unsigned long long>(ring.buffer_frames * 4 - total, src.remaining);
+      if ((len = want ? read_fd(src.fd, p + total, want) : 0) <= 0)
+        break;
+      total += len;
+      src.remaining -= len;
+    }
+    if (len < 0) {
+      fprintf(stderr, "Failed to read input\n");
+      ring.read_error = true;
+    }
+    buf.frames = total / 4;
+    buf.end = len <= 0;
+    src.partial_len = total % 4;
+    memcpy(src.partial, p + buf.frames * 4, src.partial_len);
+    buf.captured = std::chrono::steady_clock::now();
+    ring.captured.store(seq + 1, std::memory_order_release);
+    if (buf.end) return;
+  }
+}
+
+static bool read_exact(int fd, void* buf, size_t len) {
+  uint8_t* p = (uint8_t*)buf;
+  while (len) {
+    long ret = read_fd(fd, p, len);
+    if (ret <= 0) return false;
+    p += ret;
+    len -= ret;
+  }
+  return true;
+}
+
+static bool skip_exact(int fd, unsigned long long len) {
+  uint8_t buf[4096];
+  while (len) {
+    size_t want = (size_t)std::min<unsigned long long>(len, sizeof(buf));
+    if (!read_exact(fd, buf, want)) return false;
+    len -= want;
+  }
+  return true;
+}
+
+static uint16_t get16(const uint8_t* p) { return p[0] | (p[1] << 8); }
+static uint32_t get32(const uint8_t* p) { return get16(p) | ((uint32_t)get16(p + 2) << 16); }
+static void put16(uint8_t* p, uint16_t v) { p[0] = (uint8_t)v; p[1] = (uint8_t)(v >> 8); }
+static void put32(uint8_t* p, uint32_t v) { put16(p, (uint16_t)v); put16(p + 2, (uint16_t)(v >> 16)); }
+
+/* An unpatched MS2109 says it sends 96000Hz mono, but what arrives is the same 48000Hz stereo
+*  (stray sample and all) that a patched one sends. Raw PCM is byte for byte the same either
+*  way, so only a WAV header needs changing: this copies the header through up to the start of
+*  the audio, relabelling the format as 48000Hz stereo.
+*  Raw input doesn't start with "RIFF"; those first bytes are handed back as audio.
+*  Chunks other than the format are copied through if they're small, larger ones (cover art
+*  and such) are dropped rather than held in memory.
+*/
+static bool copy_wav_header(capture_source& src, int out) {
+  uint8_t riff[12];
+  if (!read_exact(src.fd, riff, 4)) {
+    src.partial_len = 0;
+    return true; // empty input, nothing to do
+  }
+  if (memcmp(riff, "RIFF", 4)) {
+    memcpy(src.partial, riff, 4);
+    src.partial_len = 4;
+    return true;
+  }
+  if (!read_exact(src.fd, riff + 4, 8) || memcmp(riff + 8, "WAVE", 4)) {
+    fprintf(stderr, "Input isn't a WAV file\n");
+    return false;
+  }
+
+  std::vector<uint8_t> header(riff, riff + 12);
+  bool have_format = false;
+  for (;;) {
+    uint8_t chunk[8];
+    if (!read_exact(src.fd, chunk, 8)) {
+      fprintf(stderr, "WAV file has no data\n");
+      return false;
+    }
+    uint32_t size = get32(chunk + 4);
+    if (!memcmp(chunk, "data", 4)) {
+      if (!have_format) {
+        fprintf(stderr, "WAV file has no format\n");
+        return false;
+      }
+      // streaming writers (arecord to a pipe) leave the sizes as 0 or all ones, otherwise drop any partial frame
+      if (size != 0 && size != 0xFFFFFFFF) {
+        src.remaining = size;
+        put32(chunk + 4, size & ~3);
+        put32(&header[4], get32(&header[4]) - (size & 3));
+      }
+      header.insert(header.end(), chunk, chunk + 8);
+      break;
+    }
+
+    bool is_format = !memcmp(chunk, "fmt ", 4);
+    unsigned long long padded = (unsigned long long)size + (size & 1);
+    if (is_format && (size < 16 || size > MAX_WAV_CHUNK)) {
+      fprintf(stderr, "WAV file has a bad format chunk (%u bytes)\n", size);
+      return false;
+    }
+    if (padded > MAX_WAV_CHUNK) {
+      if (!skip_exact(src.fd, padded)) {
+        fprintf(stderr, "WAV file is truncated\n");
+        return false;
+      }
+      uint32_t riff_size = get32(&header[4]);
+      if (riff_size != 0xFFFFFFFF && riff_size >= padded + 8)
+        put32(&header[4], riff_size - (uint32_t)(padded + 8));
+      continue;
+    }
+
+    size_t offset = header.size() + 8;
+    header.insert(header.end(), chunk, chunk + 8);
+    header.resize(offset + padded);
+    if (!read_exact(src.fd, &header[offset], padded)) {
+      fprintf(stderr, "WAV file is truncated\n");
+      return false;
+    }
+    if (!is_format)
+      continue;
+
+    uint8_t* fmt = &header[offset];
+    uint16_t tag = get16(fmt);
+    uint16_t channels = get16(fmt + 2);
+    uint32_t rate = get32(fmt + 4);
+    if ((tag != 1 && tag != 0xFFFE) || get16(fmt + 14) != 16 ||
+      !((channels == 2 && rate == 48000) || (channels == 1 && rate == 96000))) {
+      fprintf(stderr, "Expected 16-bit PCM at 48000Hz stereo or 96000Hz mono, got %uHz %u channel(s) %u-bit (format %04X)\n",
+        rate, channels, get16(fmt + 14), tag);
+      return false;
+    }
+    if (channels == 1)
+      fprintf(stderr, "Reinterpreting 96000Hz mono as 48000Hz stereo\n");
+    put16(fmt + 2, 2);
+    put32(fmt + 4, SAMPLE_RATE);
+    put32(fmt + 8, SAMPLE_RATE * 4);
+    put16(fmt + 12, 4);
+    // WAVE_FORMAT_EXTENSIBLE has a speaker mask too
+    if (tag == 0xFFFE && size >= 24)
+      put32(fmt + 20, 3);
+    have_format = true;
+  }
+
+  if (!write_fd(out, header.data(), header.size())) {
+    fprintf(stderr, "Failed to write output\n");
+    return false;
+  }
+  return true;
+}
+
+static void fix_stage(buffer_ring& ring) {
+  stereo_fix fix;
+  for (size_t seq = 0; ring.wait_for(ring.captured, seq + 1); seq++) {
+    audio_buffer& buf = ring.at(seq);
+    fix.process(buf.samples, buf.frames);
+    buf.fixed = std::chrono::steady_clock::now();
+    ring.fixed.store(seq + 1, std::memory_order_release);
+    if (buf.end) return;
+  }
+}
+
+static int filter(int in, int out, size_t buffer_frames, size_t buffer_count, bool stats) {
+  capture_source src;
+  src.fd = in;
+  if (!copy_wav_header(src, out))
+    return -1;
+
+  auto ring_ref = std::make_shared<buffer_ring>(buffer_count, buffer_frames);
+  buffer_ring& ring = *ring_ref;
+  std::thread capture(capture_stage, ring_ref, src);
+  std::thread fixer(fix_stage, std::ref(ring));
+
+  double max_fix = 0, max_sink = 0;
+  unsigned long long frames = 0;
+  int ret = 0;
+  for (size_t seq = 0; ring.wait_for(ring.fixed, seq + 1); seq++) {
+    audio_buffer& buf = ring.at(seq);
+    if (!write_fd(out, buf.samples, buf.frames * 4)) {
+      fprintf(stderr, "Failed to write output\n");
+      ring.failed = true;
+      ret = -1;
+      break;
+    }
+    auto now = std::chrono::steady_clock::now();
+    max_fix = std::max(max_fix, std::chrono::duration<double, std::milli>(buf.fixed - buf.captured).count());
+    max_sink = std::max(max_sink, std::chrono::duration<double, std::milli>(now - buf.fixed).count());
+    frames += buf.frames;
+    bool end = buf.end;
+    ring.written.store(seq + 1, std::memory_order_release);
+    if (end) break;
+  }
+
+  fixer.join();
+  // a capture stage stuck in a blocking read can't be woken up, the process exit will take care of it
+  if (ret == 0) capture.join();
+  else capture.detach();
+  if (ring.read_error)
+    ret = -1;
+
+  if (stats) {
+    fprintf(stderr, "%llu frames, %u x %u frame buffers (%.1fms each)\n", frames, (unsigned)buffer_count, (unsigned)buffer_frames,
+      buffer_frames * 1000.0 / SAMPLE_RATE);
+    fprintf(stderr, "  worst latency capture -> fix %.3fms, fix -> written %.3fms\n", max_fix, max_sink);
+  }
+  return ret;
+}
+
+static void usage(const char* argv0) {
+  fprintf(stderr, "Usage: %s [options]\n"
+    "Fixes the swapped, out of phase stereo from an MS2109 (16-bit PCM, raw or WAV)\n"
+    "Input can be 48000Hz stereo from a patched device or 96000Hz mono from an unpatched one,\n"
+    "the output is always 48000Hz stereo\n"
+    "  --in <file>           read from a file instead of stdin\n"
+    "  --out <file>          write to a file instead of stdout\n"
+    "  --buffer <frames>     frames processed at a time (default 480, 10ms)\n"
+    "  --buffers <n>         buffers in the pipeline between capture and output (default 8)\n"
+    "  --stats               print the worst latency of each stage when done\n"
+    "  --bench               check the output and measure how much faster than realtime it runs\n"
+    , argv0);
+}
+
+int main(int argc, char* argv[])
+{
+  const char* in_file = NULL;
+  const char* out_file = NULL;
+  size_t buffer_frames = 480;
+  size_t buffer_count = 8;
+  bool bench = false;
+  bool stats = false;
+
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    const char* val = i + 1 < argc ? argv[i + 1] : NULL;
+    if (!strcmp(arg, "--in") && val) in_file = argv[++i];
+    else if (!strcmp(arg, "--out") && val) out_file = argv[++i];
+    else if (!strcmp(arg, "--buffer") && val) buffer_frames = strtoul(argv[++i], NULL, 0);
+    else if (!strcmp(arg, "--buffers") && val) buffer_count = strtoul(argv[++i], NULL, 0);
+    else if (!strcmp(arg, "--bench")) bench = true;
+    else if (!strcmp(arg, "--stats")) stats = true;
+    else {
+      usage(argv[0]);
+      return -1;
+    }
+  }
+  if (buffer_frames == 0 || buffer_count == 0) {
+    usage(argv[0]);
+    return -1;
+  }
+
+  if (bench)
+    return benchmark(buffer_frames);
+
+#ifdef _WIN32
+  _setmode(0, _O_BINARY);
+  _setmode(1, _O_BINARY);
+#endif
+  int in = 0, out = 1;
+  if (in_file && (in = open_fd(in_file, false)) < 0) {
+    fprintf(stderr, "Failed to open %s\n", in_file);
+    return -1;
+  }
+  if (out_file && (out = open_fd(out_file, true)) < 0) {
+    fprintf(stderr, "Failed to create %s\n", out_file);
+    return -1;
+  }
+
+  int ret = filter(in, out, buffer_frames, buffer_count, stats);
+  if (in != 0) close_fd(in);
+  if (out != 1 && !close_fd(out)) ret = -1;
+  return ret;
+}
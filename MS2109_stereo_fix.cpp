@@ -1,14 +1,57 @@
 #include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <signal.h>
+#ifdef _WIN32
 #include <Windows.h>
 #include <SetupAPI.h>
 #include <hidsdi.h>
 #include <cfgmgr32.h>
 #include <tchar.h>
+#include <io.h>
+#include <initguid.h>
+#include <devpkey.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <linux/hidraw.h>
+#include <linux/uhid.h>
+#include <sys/inotify.h>
+#endif
+typedef bool BOOLEAN;
+typedef char TCHAR;
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HAVE_SSE2
+#endif
 
 /* compile from the command line:
-*  "cl MS2109_stereo_fix.cpp hid.lib setupapi.lib shell32.lib"
+*  "cl MS2109_stereo_fix.cpp hid.lib setupapi.lib shell32.lib cfgmgr32.lib advapi32.lib"
+*  or on Linux (uses hidraw, so needs read/write access to /dev/hidraw*):
+*  "g++ -O2 -pthread MS2109_stereo_fix.cpp"
+*  On other platforms only the simulator is available (see --simulate).
 */
 
 // change these if your Macrosilicon 2109 doesn't use the standard VID/PIDs
@@ -35,21 +78,245 @@
 #define ADDR_SATURATION             0xFE92
 #define ADDR_HUE                    0xFE93
 
-/* I don't have a device with a 24C32/23C64 EEPROM but in theory they should work...
-*  The difference is data byte 4 in the feature report must be 1 instead of 0 to use
-*  16-bit I2C addressing instead of what the smaller EEPROMs use (a single address
-*  byte with the upper 3 address bits packed into the I2C device 3 lower bits)
+struct feature_report {
+  uint8_t report_id; // always 0
+  uint8_t cmd; // E5 = read eeprom, E6 = write eeprom, B5 = read XDATA, B6 = write XDATA, C5/C6 = read/write ???
+  uint8_t address_hi;
+  uint8_t address_lo;
+  uint8_t data[5];
+};
+
+/* Timing of every feature report exchange, to find out where the time goes (USB stack or
+*  EEPROM). Each thread records into its own ring buffer so nothing is locked on the hot path;
+*  the rings are only read at exit, once the worker threads are finished.
+*/
+typedef std::chrono::steady_clock trace_clock;
+static const trace_clock::time_point trace_epoch = trace_clock::now();
+
+struct trace_event {
+  trace_clock::time_point start;
+  uint32_t duration_ns;
+  uint8_t cmd;
+  BOOLEAN ok;
+};
+
+struct trace_ring {
+  static const size_t SIZE = 1 << 14; // must be a power of 2
+
+  void push(const trace_event& e) {
+    uint64_t h = head.load(std::memory_order_relaxed);
+    events[h & (SIZE - 1)] = e;
+    head.store(h + 1, std::memory_order_release);
+  }
+
+  unsigned id = 0;
+  std::string name;
+  std::atomic<uint64_t> head{ 0 };
+  trace_event events[SIZE];
+};
+
+static std::mutex trace_rings_lock;
+static std::vector<trace_ring*> trace_rings;
+
+static trace_ring* this_thread_ring(void) {
+  static thread_local trace_ring* ring = NULL;
+  if (ring == NULL) {
+    // only happens once per thread
+    ring = new trace_ring;
+    std::lock_guard<std::mutex> lock(trace_rings_lock);
+    ring->id = (unsigned)trace_rings.size();
+    trace_rings.push_back(ring);
+  }
+  return ring;
+}
+
+static inline void trace_command(uint8_t cmd, trace_clock::time_point start, BOOLEAN ok) {
+  trace_event e;
+  e.start = start;
+  e.duration_ns = (uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(trace_clock::now() - start).count();
+  e.cmd = cmd;
+  e.ok = ok;
+  this_thread_ring()->push(e);
+}
+
+// names the calling thread's events in the trace output
+static void trace_thread_name(const std::string& name) {
+  this_thread_ring()->name = name;
+}
+
+// sleeps for the bulk of long waits and spins for the rest, since sleep_for alone is far too coarse for sub-ms waits
+static void wait_until(trace_clock::time_point until) {
+  auto left = until - trace_clock::now();
+  if (left > std::chrono::milliseconds(2))
+    std::this_thread::sleep_for(left - std::chrono::milliseconds(1));
+  while (trace_clock::now() < until)
+    std::this_thread::yield();
+}
+
+/* Everything we do to the MS2109 is a feature report exchange: SetFeature sends the command
+*  and address (plus data for writes), and for reads a following GetFeature returns the data.
+*  The transport hides where those reports actually go - the real HID interface or the
+*  simulator below - so the rest of the code doesn't care.
+*/
+class ms2109_transport {
+public:
+  virtual ~ms2109_transport() {}
+
+  BOOLEAN set_feature(feature_report& rep) {
+    ++reports;
+    trace_clock::time_point start = trace_clock::now();
+    BOOLEAN ok = do_set_feature(rep);
+    // a read isn't finished until its GetFeature, so it gets traced from there
+    if (is_read_command(rep.cmd) && ok) {
+      read_cmd = rep.cmd;
+      read_start = start;
+    }
+    else trace_command(rep.cmd, start, ok);
+    return ok;
+  }
+  BOOLEAN get_feature(feature_report& rep) {
+    ++reports;
+    BOOLEAN ok = do_get_feature(rep);
+    trace_command(read_cmd, read_start, ok);
+    return ok;
+  }
+
+  /* Runs a batch of commands back to back: each report is sent with SetFeature and for
+  *  read commands (E5/B5) the GetFeature response is stored back into the same slot.
+  *  Returns how many commands completed; it stops at the first failure.
+  */
+  size_t transact(feature_report* reps, size_t count) {
+    size_t done = do_transact(reps, count);
+    for (size_t i = 0; i < done; i++)
+      reports += is_read_command(reps[i].cmd) ? 2 : 1;
+    if (done < count) ++reports; // the failed one was still attempted
+    return done;
+  }
+
+  static BOOLEAN is_read_command(uint8_t cmd) { return cmd == 0xE5 || cmd == 0xB5; }
+
+  // number of feature reports exchanged so far, useful for benchmarking
+  unsigned long reports = 0;
+
+protected:
+  virtual BOOLEAN do_set_feature(feature_report& rep) = 0;
+  virtual BOOLEAN do_get_feature(feature_report& rep) = 0;
+
+  // backends that can do better than one call at a time override this (and call trace_command() themselves)
+  virtual size_t do_transact(feature_report* reps, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+      uint8_t cmd = reps[i].cmd;
+      trace_clock::time_point start = trace_clock::now();
+      BOOLEAN ok = do_set_feature(reps[i]) && (!is_read_command(cmd) || do_get_feature(reps[i]));
+      trace_command(cmd, start, ok);
+      if (!ok)
+        return i;
+    }
+    return count;
+  }
+
+private:
+  // forwards reports that the hidraw transport on the other end has already counted and traced
+  friend class uhid_device;
+
+  uint8_t read_cmd = 0;
+  trace_clock::time_point read_start;
+};
+
+/* What's remembered about a patched device between runs, see fingerprint_cache */
+struct device_fingerprint {
+  uint32_t version = 0; // EEPROM bytes 12-15, usually a date
+  uint16_t eeprom_size = 0;
+  uint16_t code_size = 0; // with the patch in it
+};
+
+/* Everything we know about one MS2109. Each device has its own, so several of them can be
+*  worked on at the same time from different threads.
 */
-uint16_t max_eeprom_address = 0x800;
+struct ms2109_device {
+  ~ms2109_device() {
+    delete transport;
+    free(instance);
+  }
+
+  ms2109_transport* transport = NULL;
+
+  /* I don't have a device with a 24C32/23C64 EEPROM but in theory they should work...
+  *  The difference is data byte 4 in the feature report must be 1 instead of 0 to use
+  *  16-bit I2C addressing instead of what the smaller EEPROMs use (a single address
+  *  byte with the upper 3 address bits packed into the I2C device 3 lower bits)
+  */
+  uint16_t max_eeprom_address = 0x800;
+  // set once max_eeprom_address is known to be right, by identify_eeprom() or from the cache
+  BOOLEAN eeprom_identified = false;
+
+  /* instance ID of the USB composite device, passed to reset_devices() to remove the old driver.
+  * This is necessary because windows is too stupid to realize the device descriptor has
+  * changed and will keep trying to use the old format (it caches the descriptors in the
+  * registry), which will make directshow fail with vague/mysterious errors.
+  */
+  TCHAR* instance = NULL;
+
+  // write each byte with its own read-back, the way the patcher originally worked (--legacy-writes)
+  BOOLEAN verify_each_write = false;
+
+  /* How long this device's EEPROM takes to finish a write, measured by polling until the new
+  *  value reads back. Once there are enough samples writes are simply paced by it.
+  */
+  double write_cycle_us = 0;
+  unsigned write_cycle_samples = 0;
+
+  // put in front of every message when more than one device is being worked on
+  std::string label;
+  // no messages at all, for self tests that run the same job over and over
+  BOOLEAN quiet = false;
+
+  /* Where EEPROM writes get planned before any of them happen, so a run that gets interrupted
+  *  (device unplugged, power lost) can be finished by the next one. Empty = no journal.
+  */
+  std::string journal_file;
+
+  // filled in as the device gets identified and patched, and saved to the cache afterwards
+  device_fingerprint fingerprint;
+  BOOLEAN fingerprint_valid = false;
+  // the EEPROM has been rewritten in a way no fingerprint describes (flashed), forget the device
+  BOOLEAN fingerprint_stale = false;
 
-HANDLE ms2109 = INVALID_HANDLE_VALUE;
+  int result = 0;
+  double seconds = 0;
+};
+
+// printf to stderr for one device, with its label in front
+static void dev_printf(ms2109_device& dev, const char* fmt, ...) {
+  if (dev.quiet)
+    return;
+  char msg[512];
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(msg, sizeof(msg), fmt, args);
+  va_end(args);
+  // one fprintf per message so lines from different threads don't get mixed up
+  if (dev.label.empty())
+    fputs(msg, stderr);
+  else {
+    std::string out;
+    for (const char* line = msg; *line; ) {
+      const char* end = strchr(line, '\n');
+      size_t len = end ? end - line + 1 : strlen(line);
+      if (len > 1) out += dev.label + ": ";
+      out.append(line, len);
+      line += len;
+    }
+    fputs(out.c_str(), stderr);
+  }
+}
 
-/* instance ID of the USB composite device, passed to pnputil to remove the old driver.
- * This is necessary because windows is too stupid to realize the device descriptor has
- * changed and will keep trying to use the old format (it caches the descriptors in the
- * registry), which will make directshow fail with vague/mysterious errors.
- */
-TCHAR* ms2109_instance = NULL;
+// instance IDs are plain ASCII, this just makes them printable whatever TCHAR is
+static std::string narrow(const TCHAR* s) {
+  std::string out;
+  while (s && *s) out += (char)*s++;
+  return out;
+}
 
 /* EEPROM layout (multibyte values are big-endian):
 *  Bytes 0-1: 0xA5 0x5A or 0x96 0x69
@@ -88,6 +355,8 @@ TCHAR* ms2109_instance = NULL;
 *  Alternatively it would be possible to use the USB_int hook to check if bit 2 of byte [33] is set. If it is set, clear it, call code@6069, then patch the audio format descriptor.
 *  6069 seems to be the function that loads the configuration descriptor into XDATA from CODE.
 *  Not all firmwares hook USB_int though so I went with the more "universal" method.
+*  The patch code and the places it can hook in are described by code_patch and hook_sites[]; any number of patches
+*  get applied together by build_patched_image(), so they cost one round of EEPROM writes between them.
 *
 *  Note that this simply makes the host PC interpret the audio as stereo instead of mono; the MS2109 has a bug that causes it to emit one extra sample at the beginning
 *  which causes:
@@ -95,8 +364,22 @@ TCHAR* ms2109_instance = NULL;
 *   b) out of phase by one sample
 */
 
-// This is just junk to get the USB device's instance ID to pass to pnputil. It's not essential for the patching process.
-static void get_device_instance_name(DEVINST hid_child) {
+#ifdef _WIN32
+class hid_transport : public ms2109_transport {
+public:
+  hid_transport(HANDLE h) : handle(h) {}
+  ~hid_transport() { CloseHandle(handle); }
+
+protected:
+  BOOLEAN do_set_feature(feature_report& rep) { return HidD_SetFeature(handle, &rep, sizeof(rep)); }
+  BOOLEAN do_get_feature(feature_report& rep) { return HidD_GetFeature(handle, &rep, sizeof(rep)); }
+
+private:
+  HANDLE handle;
+};
+
+// This is just junk to get the USB device's instance ID to pass to reset_devices(). It's not essential for the patching process.
+static void get_device_instance_name(ms2109_device& dev, DEVINST hid_child) {
   DEVINST hid_intf;
   if (CM_Get_Parent(&hid_intf, hid_child, 0) != CR_SUCCESS)
     return;
@@ -110,17 +393,33 @@ static void get_device_instance_name(DEVINST hid_child) {
   if (CM_Get_Device_ID_Size(&len, composite, 0) != CR_SUCCESS)
     return;
 
-  ms2109_instance = (TCHAR*)malloc(sizeof(TCHAR) * (len + 1));
-  if (ms2109_instance != NULL) {
-    if (CM_Get_Device_ID(composite, ms2109_instance, len + 1, 0) != CR_SUCCESS || _tcsncmp(ms2109_instance, TEXT("USB\\VID_534D&PID_2109\\"), 22)!=0) {
-      free(ms2109_instance);
-      ms2109_instance = NULL;
+  dev.instance = (TCHAR*)malloc(sizeof(TCHAR) * (len + 1));
+  if (dev.instance != NULL) {
+    if (CM_Get_Device_ID(composite, dev.instance, len + 1, 0) != CR_SUCCESS || _tcsncmp(dev.instance, TEXT("USB\\VID_534D&PID_2109\\"), 22)!=0) {
+      free(dev.instance);
+      dev.instance = NULL;
     }
   }
 }
 
-// get a handle for the HID interface on the MS2109. We need this to get/set feature reports.
-static void find_device(void) {
+// takes ownership of handle; returns NULL (and closes it) if it isn't an MS2109
+static ms2109_device* open_hid_device(HANDLE handle, DEVINST devinst) {
+  HIDD_ATTRIBUTES attrib;
+  attrib.Size = sizeof(attrib);
+  if (HidD_GetAttributes(handle, &attrib) && attrib.VendorID==MS2109_VID && attrib.ProductID==MS2109_PID) {
+    fprintf(stderr, "Found MS2109 device, VID %04X PID %04X bcdVersion %04X\n", attrib.VendorID, attrib.ProductID, attrib.VersionNumber);
+    ms2109_device* dev = new ms2109_device;
+    dev->transport = new hid_transport(handle);
+    if (devinst) get_device_instance_name(*dev, devinst);
+    return dev;
+  }
+
+  CloseHandle(handle);
+  return NULL;
+}
+
+// get a handle for the HID interface of every attached MS2109. We need this to get/set feature reports.
+static void find_devices(std::vector<ms2109_device*>& devices) {
   GUID guid;
   HDEVINFO info;
 
@@ -152,404 +451,3542 @@ static void find_device(void) {
       continue;
     }
 
-    HANDLE dev = CreateFile(details->DevicePath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+    HANDLE handle = CreateFile(details->DevicePath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
     free(details);
-    if (dev == INVALID_HANDLE_VALUE)
+    if (handle == INVALID_HANDLE_VALUE)
       continue;
 
-    HIDD_ATTRIBUTES attrib;
-    attrib.Size = sizeof(attrib);
-    if (HidD_GetAttributes(dev, &attrib) && attrib.VendorID==MS2109_VID && attrib.ProductID==MS2109_PID) {
-      fprintf(stderr, "Found MS2109 device, VID %04X PID %04X bcdVersion %04X\n", attrib.VendorID, attrib.ProductID, attrib.VersionNumber);
-      ms2109 = dev;
-      get_device_instance_name((DEVINST)devinfo.DevInst);
-      break;
-    }
-
-    CloseHandle(dev);
+    ms2109_device* dev = open_hid_device(handle, (DEVINST)devinfo.DevInst);
+    if (dev)
+      devices.push_back(dev);
   }
 
   SetupDiDestroyDeviceInfoList(info);
 }
 
-struct feature_report {
-  uint8_t report_id; // always 0
-  uint8_t cmd; // E5 = read eeprom, E6 = write eeprom, B5 = read XDATA, B6 = write XDATA, C5/C6 = read/write ???
-  uint8_t address_hi;
-  uint8_t address_lo;
-  uint8_t data[5];
-};
+// opens the HID interface at path if it belongs to an MS2109, NULL otherwise
+static ms2109_device* open_device(const std::string& path, BOOLEAN report_errors) {
+  std::wstring wpath(path.begin(), path.end());
+  HANDLE handle = CreateFileW(wpath.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+  if (handle == INVALID_HANDLE_VALUE)
+    return NULL;
+
+  // the interface path only leads to the devnode through its instance ID
+  DEVINST devinst = 0;
+  WCHAR id[MAX_DEVICE_ID_LEN];
+  ULONG size = sizeof(id);
+  DEVPROPTYPE type;
+  if (CM_Get_Device_Interface_PropertyW(wpath.c_str(), &DEVPKEY_Device_InstanceId, &type, (PBYTE)id, &size, 0) != CR_SUCCESS
+    || CM_Locate_DevNodeW(&devinst, id, CM_LOCATE_DEVNODE_NORMAL) != CR_SUCCESS)
+    devinst = 0;
+  return open_hid_device(handle, devinst);
+}
 
-template <class c>
-static BOOLEAN read_eeprom(uint16_t address, c& val) {
-  if (address >= max_eeprom_address) return false;
-  feature_report rep = {};
-  rep.report_id = 0;
-  rep.cmd = 0xE5;
-  rep.address_hi = (uint8_t)(address >> 8);
-  rep.address_lo = (uint8_t)address;
-  rep.data[4] = max_eeprom_address >> 12;
-  if (HidD_SetFeature(ms2109, &rep, sizeof(rep))) {
-    if (HidD_GetFeature(ms2109, &rep, sizeof(rep))) {
-      val = 0;
-      for (int i = 0; i < sizeof(c); i++) {
-        val = (val << 8) | rep.data[i];
-      }
+/* Reports HID interfaces as they arrive. The notification callback runs on a system thread and
+*  only queues the interface path; opening the device is left to whoever calls wait().
+*/
+class hotplug_watcher {
+public:
+  ~hotplug_watcher() {
+    if (notify) CM_Unregister_Notification(notify);
+  }
+
+  // starts listening, then lists the HID interfaces that are already there
+  BOOLEAN start(std::vector<std::string>& present) {
+    CM_NOTIFY_FILTER filter;
+    memset(&filter, 0, sizeof(filter));
+    filter.cbSize = sizeof(filter);
+    filter.FilterType = CM_NOTIFY_FILTER_TYPE_DEVICEINTERFACE;
+    HidD_GetHidGuid(&filter.u.DeviceInterface.ClassGuid);
+    if (CM_Register_Notification(&filter, this, callback, &notify) != CR_SUCCESS)
+      return false;
+
+    ULONG len;
+    if (CM_Get_Device_Interface_List_SizeW(&len, &filter.u.DeviceInterface.ClassGuid, NULL, CM_GET_DEVICE_INTERFACE_LIST_PRESENT) != CR_SUCCESS)
       return true;
+    std::vector<WCHAR> list(len + 1);
+    if (CM_Get_Device_Interface_ListW(&filter.u.DeviceInterface.ClassGuid, NULL, list.data(), len, CM_GET_DEVICE_INTERFACE_LIST_PRESENT) != CR_SUCCESS)
+      return true;
+    for (const WCHAR* p = list.data(); *p; p += wcslen(p) + 1)
+      present.push_back(std::string(p, p + wcslen(p)));
+    return true;
+  }
+
+  // waits up to timeout_ms for something to happen and adds the paths of whatever arrived or went away
+  void wait(std::vector<std::string>& arrived, std::vector<std::string>& removed, unsigned timeout_ms) {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait_for(lock, std::chrono::milliseconds(timeout_ms), [this] { return !arrivals.empty() || !removals.empty(); });
+    arrived.insert(arrived.end(), arrivals.begin(), arrivals.end());
+    removed.insert(removed.end(), removals.begin(), removals.end());
+    arrivals.clear();
+    removals.clear();
+  }
+
+private:
+  static DWORD CALLBACK callback(HCMNOTIFICATION, PVOID context, CM_NOTIFY_ACTION action, PCM_NOTIFY_EVENT_DATA data, DWORD) {
+    if (action == CM_NOTIFY_ACTION_DEVICEINTERFACEARRIVAL || action == CM_NOTIFY_ACTION_DEVICEINTERFACEREMOVAL) {
+      hotplug_watcher* watcher = (hotplug_watcher*)context;
+      const WCHAR* link = data->u.DeviceInterface.SymbolicLink;
+      std::lock_guard<std::mutex> lock(watcher->mutex);
+      (action == CM_NOTIFY_ACTION_DEVICEINTERFACEARRIVAL ? watcher->arrivals : watcher->removals).push_back(std::string(link, link + wcslen(link)));
+      watcher->cv.notify_one();
     }
-    else fprintf(stderr, "Failed to read EEPROM @ %04X\n", address);
+    return ERROR_SUCCESS;
   }
-  else fprintf(stderr, "Failed to set EEPROM read address %04X\n", address);
-  return false;
-}
 
-static BOOLEAN read_eeprom_byte( uint16_t address, uint8_t& val) {
-  return read_eeprom(address, val);
-}
+  HCMNOTIFICATION notify = NULL;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::vector<std::string> arrivals, removals;
+};
+#endif
 
-static BOOLEAN read_eeprom_word(uint16_t address, uint16_t& val) {
-  return read_eeprom(address, val);
-}
+#ifdef __linux__
+/* Linux backend, talks to the hidraw node for the MS2109's HID interface.
+*  There's no way to hand the kernel more than one feature report per syscall, so batches
+*  are issued as back-to-back ioctls straight from the calling thread: no per-report
+*  bookkeeping, error formatting or virtual dispatch in between.
+*/
+class hidraw_transport : public ms2109_transport {
+public:
+  hidraw_transport(int f) : fd(f) {}
+  ~hidraw_transport() { close(fd); }
+
+protected:
+  BOOLEAN do_set_feature(feature_report& rep) { return ioctl(fd, HIDIOCSFEATURE(sizeof(rep)), &rep) >= 0; }
+  BOOLEAN do_get_feature(feature_report& rep) {
+    rep.report_id = 0;
+    return ioctl(fd, HIDIOCGFEATURE(sizeof(rep)), &rep) >= 0;
+  }
 
-static BOOLEAN read_eeprom_dword(uint16_t address, uint32_t& val) {
-  return read_eeprom(address, val);
-}
+private:
+  int fd;
+};
 
-static BOOLEAN write_eeprom_byte(uint16_t address, uint8_t src) {
-  if (address >= max_eeprom_address) return false;
-  feature_report rep = {};
-  rep.report_id = 0;
-  rep.cmd = 0xE6;
-  rep.address_hi = (uint8_t)(address >> 8);
-  rep.address_lo = (uint8_t)address;
-  rep.data[0] = src;
-  rep.data[4] = max_eeprom_address >> 12;
-  if (HidD_SetFeature(ms2109, &rep, sizeof(rep))) {
-    uint8_t d;
-    if (!read_eeprom_byte(address, d))
-      return false;
-    if (d != src) {
-      fprintf(stderr, "Failed to verify EEPROM @ %04X after writing (expected %02X actual %02X)\n", address, src, d);
-      return false;
+static BOOLEAN read_sysfs_line(const std::string& path, const char* key, std::string& value) {
+  FILE* f = fopen(path.c_str(), "r");
+  if (f == NULL)
+    return false;
+  char line[256];
+  size_t keylen = strlen(key);
+  BOOLEAN found = false;
+  while (!found && fgets(line, sizeof(line), f)) {
+    if (strncmp(line, key, keylen) == 0) {
+      value = line + keylen;
+      while (!value.empty() && (value.back() == '\n' || value.back() == '\r'))
+        value.pop_back();
+      found = true;
     }
-    return true;
   }
-  else fprintf(stderr, "Failed to write EEPROM @ %04X\n", address);
-  return false;
+  fclose(f);
+  return found;
 }
 
-static BOOLEAN write_eeprom_word(uint16_t address, uint16_t src) {
-  if (!write_eeprom_byte(address, (uint8_t)(src >> 8)))
-    return false;
-  if (!write_eeprom_byte(address + 1, (uint8_t)src))
-    return false;
-  return true;
+/* The hidraw device's sysfs node is the HID device, whose parent is the USB interface and
+*  grandparent the USB device itself ("1-2", "3-1.4" etc). That's our equivalent of the
+*  Windows instance ID.
+*/
+static void get_device_instance_name(ms2109_device& dev, const std::string& hidraw_sysfs) {
+  char resolved[PATH_MAX];
+  if (realpath((hidraw_sysfs + "/device/../..").c_str(), resolved) == NULL)
+    return;
+  const char* name = strrchr(resolved, '/');
+  dev.instance = strdup(name ? name + 1 : resolved);
 }
 
-static BOOLEAN read_xdata_byte(uint16_t address, uint8_t& val) {
-  feature_report rep = {};
-  rep.report_id = 0;
-  rep.cmd = 0xB5;
-  rep.address_hi = (uint8_t)(address >> 8);
-  rep.address_lo = (uint8_t)address;
-  if (HidD_SetFeature(ms2109, &rep, sizeof(rep))) {
-    if (HidD_GetFeature(ms2109, &rep, sizeof(rep))) {
-      val = rep.data[0];
-      return true;
-    }
-    else fprintf(stderr, "Failed to read XDATA @ %04X\n", address);
+// opens the hidraw node at path (/dev/hidrawN) if its HID IDs in sysfs say it's an MS2109, NULL otherwise
+static ms2109_device* open_device(const std::string& path, BOOLEAN report_errors) {
+  const char* name = strrchr(path.c_str(), '/');
+  std::string sysfs = std::string("/sys/class/hidraw/") + (name ? name + 1 : path.c_str());
+  char id[64];
+  snprintf(id, sizeof(id), "0003:%08X:%08X", MS2109_VID, MS2109_PID);
+  std::string hid_id;
+  if (!read_sysfs_line(sysfs + "/device/uevent", "HID_ID=", hid_id) || strcasecmp(hid_id.c_str(), id) != 0)
+    return NULL;
+
+  int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+  if (fd < 0) {
+    if (report_errors)
+      fprintf(stderr, "Found MS2109 device at %s but couldn't open it (%s)\n", path.c_str(), strerror(errno));
+    return NULL;
   }
-  else fprintf(stderr, "Failed to set XDATA read address %04X\n", address);
-  return false;
+  fprintf(stderr, "Found MS2109 device, VID %04X PID %04X at %s\n", MS2109_VID, MS2109_PID, path.c_str());
+  ms2109_device* dev = new ms2109_device;
+  dev->transport = new hidraw_transport(fd);
+  get_device_instance_name(*dev, sysfs);
+  return dev;
 }
 
-static BOOLEAN read_xdata_word(uint16_t address, uint16_t& val) {
-  uint8_t d[2];
-  if (read_xdata_byte(address, d[1]) && read_xdata_byte(address + 1, d[0])) {
-    val = (d[1] << 8) | d[0];
-    return true;
+static void list_hidraw_nodes(std::vector<std::string>& nodes) {
+  DIR* dir = opendir("/sys/class/hidraw");
+  if (dir == NULL)
+    return;
+  struct dirent* ent;
+  while ((ent = readdir(dir)) != NULL) {
+    if (strncmp(ent->d_name, "hidraw", 6) == 0)
+      nodes.push_back(std::string("/dev/") + ent->d_name);
   }
-  return false;
+  closedir(dir);
 }
 
-static BOOLEAN write_xdata_byte(uint16_t address, uint8_t val) {
-  feature_report rep = {};
-  rep.report_id = 0;
-  rep.cmd = 0xB6;
-  rep.address_hi = (uint8_t)(address >> 8);
-  rep.address_lo = (uint8_t)address;
-  rep.data[0] = val;
-  if (HidD_SetFeature(ms2109, &rep, sizeof(rep))) {
-    return true;
+// find the hidraw nodes belonging to MS2109s
+static void find_devices(std::vector<ms2109_device*>& devices) {
+  std::vector<std::string> nodes;
+  list_hidraw_nodes(nodes);
+  for (const std::string& node : nodes) {
+    ms2109_device* dev = open_device(node, true);
+    if (dev)
+      devices.push_back(dev);
   }
-  else fprintf(stderr, "Failed to write XDATA %04X\n", address);
-  return false;
 }
 
-static BOOLEAN has_mono_descriptor(void) {
-  uint8_t audio_format_channels;
-  uint8_t audio_format_rate[3];
-
-  if (!read_xdata_byte(0xC4C5, audio_format_channels)) {
-    fprintf(stderr, "Failed to read audio format channels\n");
-    return false;
-  }
-  if (!read_xdata_byte(0xC4C9, audio_format_rate[0]) || \
-    !read_xdata_byte(0xC4CA, audio_format_rate[1]) || \
-    !read_xdata_byte(0xC4CB, audio_format_rate[2])) {
-    fprintf(stderr, "Failed to read audio format sampling rate\n");
-    return false;
+/* Reports hidraw nodes as they appear, by watching /dev with inotify. udev creates the node
+*  first and fixes up its permissions afterwards, so a node that couldn't be opened when it was
+*  created gets reported again when its attributes change.
+*/
+class hotplug_watcher {
+public:
+  ~hotplug_watcher() {
+    if (fd >= 0) close(fd);
   }
-  if (audio_format_channels != 1) {
-    fprintf(stderr, "Audio format channels was not 1 (%d)\n", audio_format_channels);
-    return false;
+
+  // starts listening, then lists the hidraw nodes that are already there
+  BOOLEAN start(std::vector<std::string>& present) {
+    fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (fd < 0 || inotify_add_watch(fd, "/dev", IN_CREATE | IN_ATTRIB | IN_DELETE) < 0)
+      return false;
+    list_hidraw_nodes(present);
+    return true;
   }
 
-  if (audio_format_rate[0] != 0x00 || audio_format_rate[1] != 0x77 || audio_format_rate[2] != 0x01) {
-    fprintf(stderr, "Audio format sampling rate was not 96000 (%d)\n", (audio_format_rate[2] << 16) | (audio_format_rate[1] << 8) | audio_format_rate[0]);
-    return false;
+  // waits up to timeout_ms for something to happen and adds the paths of whatever arrived or went away
+  void wait(std::vector<std::string>& arrived, std::vector<std::string>& removed, unsigned timeout_ms) {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    if (poll(&pfd, 1, (int)timeout_ms) <= 0)
+      return;
+    alignas(struct inotify_event) char buf[4096];
+    ssize_t len;
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+      for (char* p = buf; p < buf + len; ) {
+        struct inotify_event* ev = (struct inotify_event*)p;
+        if (ev->len && strncmp(ev->name, "hidraw", 6) == 0)
+          (ev->mask & IN_DELETE ? removed : arrived).push_back(std::string("/dev/") + ev->name);
+        p += sizeof(struct inotify_event) + ev->len;
+      }
+    }
   }
 
-  return true;
-}
+private:
+  int fd = -1;
+};
+#endif
 
-static BOOLEAN identify_eeprom() {
-  uint16_t d;
+#if !defined(_WIN32) && !defined(__linux__)
+// no device access or hotplug notifications here, only simulated devices
+static ms2109_device* open_device(const std::string&, BOOLEAN) { return NULL; }
 
-  // check xdata where the EEPROM is mapped first, to figure out what type it is
-  if (read_xdata_word(0xCBD0, d)) {
-    if (d == 0xA55A)
-      max_eeprom_address = 0x800;
-    else if (d == 0x9669)
-      max_eeprom_address = 0x1000;
-  }
+class hotplug_watcher {
+public:
+  BOOLEAN start(std::vector<std::string>&) { return false; }
+  void wait(std::vector<std::string>&, std::vector<std::string>&, unsigned) {}
+};
+#endif
 
-  if (read_eeprom_word(0, d)) {
-    if (d == 0xA55A && max_eeprom_address == 0x800)
-      return true;
-    if (d == 0x9669 && max_eeprom_address == 0x1000)
-      return true;
-    // eeprom signature didn't match expected signature, try harder...
-  }
+/* 16-bit sum of a block of bytes, as used by the EEPROM checksums. PSADBW against zero adds
+*  up 16 bytes at a time; the lane totals can't overflow for anything EEPROM sized and only the
+*  low 16 bits matter in the end anyway.
+*/
+static uint16_t sum_bytes(const uint8_t* p, size_t len) {
+  uint32_t sum = 0;
+#ifdef HAVE_SSE2
+  const __m128i zero = _mm_setzero_si128();
+  __m128i acc = zero;
+  for (; len >= 16; p += 16, len -= 16)
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)p), zero));
+  sum = (uint32_t)_mm_cvtsi128_si32(acc) + (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#endif
+  while (len--) sum += *p++;
+  return (uint16_t)sum;
+}
 
-  max_eeprom_address = 0x800;
-  if (read_eeprom_word(0, d) && d == 0xA55A)
+/* Serves E5/E6 from an EEPROM image in memory, following the same 2K/4K addressing rules as
+*  the real chip. B5 reads of XDATA 0xCBD0 onwards, where the chip maps the header and code,
+*  come from the image as well; any other XDATA is up to derived classes.
+*  Used directly for patching dump files (--image) and as the base of the simulator.
+*/
+class eeprom_image_transport : public ms2109_transport {
+public:
+  eeprom_image_transport(uint8_t* mem, size_t size) : image(mem), image_size(size) {}
+
+protected:
+  BOOLEAN do_set_feature(feature_report& rep) {
+    uint16_t address = (rep.address_hi << 8) | rep.address_lo;
+    response = rep;
+    switch (rep.cmd) {
+    case 0xE5:
+      for (int i = 0; i < 4; i++) {
+        int a = eeprom_address(rep, address + i);
+        response.data[i] = a < 0 ? 0xFF : image[a];
+      }
+      break;
+    case 0xE6: {
+      int a = eeprom_address(rep, address);
+      if (a >= 0) image[a] = rep.data[0];
+      break;
+    }
+    case 0xB5:
+      memset(response.data, 0, sizeof(response.data));
+      return read_xdata(address, response.data[0]);
+    case 0xB6:
+      return write_xdata(address, rep.data[0]);
+    default:
+      return false;
+    }
     return true;
+  }
 
-  max_eeprom_address = 0x1000;
-  if (read_eeprom_word(0, d) && d == 0x9669)
+  BOOLEAN do_get_feature(feature_report& rep) {
+    rep = response;
     return true;
+  }
 
-  fprintf(stderr, "Failed to recognize EEPROM signature (%04X)\n", d);
-  return false;
-}
-
-static BOOLEAN identify_ms2109(void) {
-  uint8_t id[3] = {};
-
-  if (read_xdata_byte(0xF800, id[0]) && \
-    read_xdata_byte(0xF801, id[1]) && \
-    read_xdata_byte(0xF802, id[2])) {
-    if (id[0] == 0xA7 && id[1] == 0x10 && id[2] == 0x9A)
-      return true;
+  virtual BOOLEAN read_xdata(uint16_t address, uint8_t& val) {
+    val = 0;
+    if (address >= 0xCBD0 && image_size >= 4 && ((image[0] == 0xA5 && image[1] == 0x5A) || (image[0] == 0x96 && image[1] == 0x69))) {
+      size_t offset = address - 0xCBD0;
+      if (offset < image_size && offset < 0x30u + ((image[2] << 8) | image[3]))
+        val = image[offset];
+    }
+    return true;
   }
 
-  fprintf(stderr, "Failed to identify MS2109 chip (%02X:%02X:%02X)\n", id[0], id[1], id[2]);
-  return false;
-}
+  virtual BOOLEAN write_xdata(uint16_t, uint8_t) { return false; }
 
+  uint8_t* image;
+  size_t image_size;
 
-static int attempt_patch(void) {
-  uint16_t data_size;
-  uint16_t hdr_sum;
-  uint16_t data_sum;
-  uint8_t audio_format_patch[] = {
-    0xEF,             // mov A, R7
-    0xB4, 0x02, 17  , // cjne A, #2, 1f    ; stage 2 = patch the audio format descriptor, else skip everything here
-    0x90, 0xC4, 0xC5, // mov DPTR, #0xC4C5 ; audio format channels byte offset
-    0xF0,             // movx @DPTR, A     ; set channels to 2
-    0x90, 0xC4, 0xC9, // mov DPTR, #0xC4C9 ; audio format sampling rate byte offset
-    0x74, 0x80,       // mov A, #0x80      ; 48000 & 0xFF
-    0xF0,             // movx @DPTR,A
-    0xA3,             // inc DPTR
-    0x74, 0xBB,       // mov A, #0xBB      ; (48000 >> 8) & 0xFF
-    0xF0,             // movx @DPTR,A
-    0xA3,             // inc DPTR
-    0xE4,             // clr A             ; 48000 >> 16
-    0xF0,             // movx @DPTR,A      ; sampling rate = 48000, not 96000
-    // 1:
-    0x90, 0x00, 0x00, // mov DPTR, #XXXX   ; instruction that was overwritten with lcall to this patch
-    0x22,             // ret
-  };
+private:
+  /* 24C16 and smaller use one address byte plus 3 bits in the I2C device address, 24C32 and
+  *  larger take two address bytes; using the wrong mode just reads back 0xFF.
+  */
+  int eeprom_address(const feature_report& rep, uint32_t address) const {
+    BOOLEAN wide = image_size > 0x800;
+    if ((rep.data[4] != 0) != wide)
+      return -1;
+    address &= wide ? 0xFFFF : 0x7FF;
+    return address < image_size ? (int)address : -1;
+  }
 
-  if (!identify_eeprom())
-    return -3;
+protected:
+  feature_report response = {};
+};
 
-  if (!read_eeprom_word(2, data_size) || data_size < 5) {
-    fprintf(stderr, "Invalid data size found: %04X\n", data_size);
-    return -4;
+/* Simulated MS2109 for testing and benchmarking without a real device. It models just
+*  enough of the chip for the patcher: E5/E6 EEPROM access with the 2K/4K addressing modes
+*  selected by data[4], B5/B6 XDATA access, the chip ID at 0xF800, the EEPROM header and
+*  code mapped to 0xCBD0 in XDATA and the (buggy) mono 96000Hz audio format descriptor at 0xC4C5.
+*  Every report takes latency_us microseconds, to approximate a USB round trip.
+*/
+class ms2109_simulator : public eeprom_image_transport {
+public:
+  ms2109_simulator(const std::vector<uint8_t>& contents, unsigned latency, unsigned write_cycle = 0) :
+    eeprom_image_transport(NULL, 0), eeprom(contents), latency_us(latency), write_cycle_us(write_cycle) {
+    image = eeprom.data();
+    image_size = eeprom.size();
+    xdata.resize(0x10000);
+    power_on();
   }
-  fprintf(stderr, "Current data size: %04X bytes\n", data_size);
 
-  if (!read_eeprom_word(data_size + 0x30, hdr_sum)) {
-    return -5;
-  }
-  if (!read_eeprom_word(data_size + 0x32, data_sum)) {
-    return -6;
+  // (re)load XDATA the same way the real chip does after being plugged in
+  void power_on(void) {
+    memset(&xdata[0], 0, xdata.size());
+    xdata[0xF800] = 0xA7;
+    xdata[0xF801] = 0x10;
+    xdata[0xF802] = 0x9A;
+    xdata[0xC4C5] = 1;    // channels
+    xdata[0xC4C9] = 0x00; // 96000
+    xdata[0xC4CA] = 0x77;
+    xdata[0xC4CB] = 0x01;
+
+    // a 1080p60 HDMI source
+    xdata[ADDR_INPUT_WIDTH] = 1920 >> 8;
+    xdata[ADDR_INPUT_WIDTH + 1] = 1920 & 0xFF;
+    xdata[ADDR_INPUT_HEIGHT] = 1080 >> 8;
+    xdata[ADDR_INPUT_HEIGHT + 1] = 1080 & 0xFF;
+    xdata[ADDR_INPUT_FPS] = 60;
+    xdata[ADDR_INPUT_PIXELCLK] = 14850 >> 8;
+    xdata[ADDR_INPUT_PIXELCLK + 1] = 14850 & 0xFF;
+    xdata[ADDR_HDMI_CONNECTION_STATUS] = 1;
+
+    // default picture settings, see the defines
+    static const int16_t settings[] = { -11, 148, 0, 180 };
+    for (int i = 0; i < 4; i++) {
+      xdata[BRIGHTNESS + i * 2] = (uint8_t)(settings[i] >> 8);
+      xdata[BRIGHTNESS + i * 2 + 1] = (uint8_t)settings[i];
+    }
+    xdata[ADDR_BRIGHTNESS] = (uint8_t)settings[0];
+    xdata[ADDR_CONTRAST] = (uint8_t)settings[1];
+    xdata[ADDR_HUE] = (uint8_t)settings[2];
+    xdata[ADDR_SATURATION] = (uint8_t)settings[3];
+
+    if (eeprom.size() >= 4 && ((eeprom[0] == 0xA5 && eeprom[1] == 0x5A) || (eeprom[0] == 0x96 && eeprom[1] == 0x69))) {
+      size_t len = 0x30 + ((eeprom[2] << 8) | eeprom[3]);
+      for (size_t i = 0; i < len && i < eeprom.size() && 0xCBD0 + i < xdata.size(); i++)
+        xdata[0xCBD0 + i] = eeprom[i];
+    }
   }
 
-  // reserved space = header size (0x30) + old checksums + new checksums
-  if (data_size > (max_eeprom_address - 0x38 - sizeof(audio_format_patch))) {
-    fprintf(stderr, "Current data size is too large to fit audio descriptor patch\n");
-    return -7;
-  }
+  // the storage behind the base class' image pointer; must not be resized
+  std::vector<uint8_t> eeprom;
+  std::vector<uint8_t> xdata;
+  unsigned latency_us;
 
-  /* TODO: we assume the sums are correct, should probably verify them and
-  *  show a warning (do not abort / fail) if they're incorrect. But it takes a long time
-  *  to read all of the existing EEPROM...
+  /* Like a real EEPROM, after each write the simulated one goes away for this long to program
+  *  the byte. Until it's done reads return 0xFF (the I2C read gets NAKed) and writes are lost.
   */
+  unsigned write_cycle_us;
 
-  // first three opcodes must be "mov DPTR, #i; mov A,R7; movx @DPTR,A" (5 bytes)
-  uint32_t op;
-  uint8_t op2;
-  if (!read_eeprom_dword(0x30, op) || !read_eeprom_byte(0x34, op2))
-    return -8;
-  if ((op & 0xFF0000FF) != 0x900000EF || op2 != 0xF0) {
-    fprintf(stderr, "Unexpected bytestream, don't know how to patch this: %08X%02X\n", op, op2);
-    if ((op & 0xFF0000FF) == 0x120000EF)
-      fprintf(stderr, "This device may have already been patched.\n");
-    return -9;
-  }
-  op = (uint16_t)(op >> 8);
-
-  fprintf(stderr, "Found Patch_Common start, DPTR immediate is %04X\n", op);
-  // for safety don't overwrite old checksums - reduces the chance of leaving the EEPROM invalid if something goes wrong
-  // so the old checksums now are included in the data...
-  data_sum = data_sum + (hdr_sum >> 8) + (uint8_t)hdr_sum + (data_sum >> 8) + (uint8_t)data_sum;
-  // the old data size will be replaced
-  hdr_sum -= data_size >> 8;
-  hdr_sum -= (uint8_t)data_size;
-  // add 4 bytes to cover the old sums
-  data_size += 4;
-  // new code will go here:
-  uint16_t patch_offset = 0xCC00 + data_size;
-
-  // update data_sum with added data
-  data_sum = data_sum - 0x90 + 0x12; // first opcode "mov DPTR, #i" will be changed to "lcall XXXX"
-  data_sum += patch_offset >> 8;     // remainder of opcode is the code offset for the patch
-  data_sum += (uint8_t)patch_offset;
-  for (int i = 0; i < sizeof(audio_format_patch); i++) {
-    data_sum += audio_format_patch[i];
-  }
-
-  /* Insert original DPTR address into patch.
-  *  These bytes were originally zeroed in the patch so they didn't add to the data sum,
-  *  and the original sum already included them - we just relocated them from the
-  *  beginning of the code to our patch, so they don't need to be summed again.
+  /* Pulls the plug on the simulated device when this EEPROM write comes in (counting from 1,
+  *  0 = never). That write is either lost or, with tear_failed_write, leaves a garbage byte
+  *  behind the way a write cut short by a power loss can. Nothing gets answered afterwards.
   */
-  audio_format_patch[sizeof(audio_format_patch) - 3] = op >> 8;
-  audio_format_patch[sizeof(audio_format_patch) - 2] = (uint8_t)op;
-
-  // write patch while updating size
-  fprintf(stderr, "Adding audio descriptor patch code\n");
-  for (int i = 0; i < sizeof(audio_format_patch); i++) {
-    if (!write_eeprom_byte(data_size+0x30, audio_format_patch[i]))
-      return -10;
-    ++data_size;
-  }
-
-  hdr_sum += data_size >> 8;
-  hdr_sum += (uint8_t)data_size;
-  // write out the new checksums first before updating data size
-  fprintf(stderr, "Updating header checksum (%04X)\n", hdr_sum);
-  if (!write_eeprom_word(data_size + 0x30, hdr_sum))
-    return -11;
-  fprintf(stderr, "Updating data checksum (%04X)\n", data_sum);
-  if (!write_eeprom_word(data_size + 0x32, data_sum))
-    return -12;
-
-  // fix the data size in the header
-  // DANGER: checksums are incorrect while initial opcode hasn't been overwritten!
-  fprintf(stderr, "Updating code size %04X bytes\n", data_size);
-  if (!write_eeprom_word(2, data_size))
-    return -13;
-
-  // overwrite the first opcode
-  fprintf(stderr, "Overwriting initial opcode\n");
-  if (!write_eeprom_byte(0x30, 0x12) || !write_eeprom_word(0x31, (uint16_t)patch_offset))
-    return -14;
-
-  fprintf(stderr, "\n\nPatching is complete!\n");
-  return 0;
-}
-
-
-int main()
-{
-  fprintf(stderr, "MS2109 firmware patcher, searching for device...\n");
-  find_device();
-  if (ms2109 == INVALID_HANDLE_VALUE) {
-    fprintf(stderr, "Failed to find MS2109 device\n");
-    return -100;
+  unsigned fail_after_writes = 0;
+  BOOLEAN tear_failed_write = false;
+  unsigned eeprom_writes = 0;
+  BOOLEAN unplugged = false;
+
+protected:
+  BOOLEAN do_set_feature(feature_report& rep) {
+    delay();
+    if (unplugged)
+      return false;
+    if (rep.cmd == 0xE5 || rep.cmd == 0xE6) {
+      trace_clock::time_point now = trace_clock::now();
+      if (now < busy_until) {
+        response = rep;
+        memset(response.data, 0xFF, 4);
+        return true;
+      }
+      if (rep.cmd == 0xE6) {
+        busy_until = now + std::chrono::microseconds(write_cycle_us);
+        if (++eeprom_writes == fail_after_writes) {
+          unplugged = true;
+          if (tear_failed_write) {
+            feature_report torn = rep;
+            torn.data[0] ^= 0x5A;
+            eeprom_image_transport::do_set_feature(torn);
+          }
+          return false;
+        }
+      }
+    }
+    return eeprom_image_transport::do_set_feature(rep);
   }
 
-  int ret;
-  if (!identify_ms2109()) {
-    fprintf(stderr, " could not confirm MS2109 chip ID!\n");
-    ret = -200;
-  }
-  else if (!has_mono_descriptor()) {
-    fprintf(stderr, " could not find mono USB audio format descriptor in XDATA; is device already patched?\n");
-    ret = -300;
+  BOOLEAN do_get_feature(feature_report& rep) {
+    delay();
+    if (unplugged)
+      return false;
+    return eeprom_image_transport::do_get_feature(rep);
   }
-  else {
-    fprintf(stderr, "Attempting to patch device\n");
 
-    /* apparently XDATA@F002 should be cleared whilst accessing EEPROM.
-    *  Maybe this is a GPIO connected to the EEPROM's WP pin
-    *  but for my devices it seems to make no difference - possibly
-    *  the cheap makers didn't bother connecting it and just grounded the pin...
-    */
-    BOOLEAN restore_f002 = false;
-    uint8_t f002;
-    if (read_xdata_byte(0xF002, f002) && f002 != 0)
-      restore_f002 = write_xdata_byte(0xF002, 0);
+  BOOLEAN read_xdata(uint16_t address, uint8_t& val) {
+    val = xdata[address];
+    return true;
+  }
 
-    ret = attempt_patch();
-    if (restore_f002) write_xdata_byte(0xF002, f002);
+  BOOLEAN write_xdata(uint16_t address, uint8_t val) {
+    xdata[address] = val;
+    return true;
   }
 
-  CloseHandle(ms2109);
-  if (ret == 0 && ms2109_instance) {
-    std::basic_string<TCHAR> params;
+private:
+  void delay(void) const {
+    if (latency_us != 0)
+      wait_until(trace_clock::now() + std::chrono::microseconds(latency_us));
+  }
 
-    fprintf(stderr, "Attempting to uninstall current USB driver for ");
-    _fputts(ms2109_instance, stderr);
-    fprintf(stderr, " using pnputil.\nPlease ensure no other applications are currently using the USB device.\nYou will need to give administrator permission for this to succeed.\n");
+  trace_clock::time_point busy_until;
+};
 
-    params = TEXT("/remove-device \"");
-    params += ms2109_instance;
-    params += TEXT("\" /subtree");
+#ifdef __linux__
+/* Exposes a transport (normally the simulator) as a real HID device through /dev/uhid, so the
+*  hidraw backend and the kernel HID stack underneath it can be exercised without hardware.
+*  Creating uhid devices usually requires root.
+*/
+class uhid_device {
+public:
+  uhid_device(ms2109_transport& t) : backend(t) {}
+  ~uhid_device() { stop(); }
+
+  BOOLEAN start(void) {
+    // one vendor-defined 8 byte feature report without a report ID, same as the real thing
+    static const uint8_t report_desc[] = {
+      0x06, 0x00, 0xFF, // Usage Page (Vendor Defined 0xFF00)
+      0x09, 0x01,       // Usage (0x01)
+      0xA1, 0x01,       // Collection (Application)
+      0x15, 0x00,       //  Logical Minimum (0)
+      0x26, 0xFF, 0x00, //  Logical Maximum (255)
+      0x75, 0x08,       //  Report Size (8)
+      0x95, 0x08,       //  Report Count (8)
+      0x09, 0x01,       //  Usage (0x01)
+      0xB1, 0x02,       //  Feature (Data,Var,Abs)
+      0xC0,             // End Collection
+    };
+
+    fd = open("/dev/uhid", O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+      fprintf(stderr, "Failed to open /dev/uhid (%s)\n", strerror(errno));
+      return false;
+    }
+
+    struct uhid_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = UHID_CREATE2;
+    strcpy((char*)ev.u.create2.name, "MS2109 simulator");
+    // so its hidraw node can be told apart from real MS2109s, see open_hidraw()
+    snprintf((char*)ev.u.create2.uniq, sizeof(ev.u.create2.uniq), "ms2109-sim-%d", (int)getpid());
+    uniq = (const char*)ev.u.create2.uniq;
+    memcpy(ev.u.create2.rd_data, report_desc, sizeof(report_desc));
+    ev.u.create2.rd_size = sizeof(report_desc);
+    ev.u.create2.bus = BUS_USB;
+    ev.u.create2.vendor = MS2109_VID;
+    ev.u.create2.product = MS2109_PID;
+    if (write(fd, &ev, sizeof(ev)) != sizeof(ev)) {
+      fprintf(stderr, "Failed to create uhid device (%s)\n", strerror(errno));
+      close(fd);
+      fd = -1;
+      return false;
+    }
+
+    quit = false;
+    worker = std::thread(&uhid_device::run, this);
+    return true;
+  }
+
+  void stop(void) {
+    if (fd < 0) return;
+    quit = true;
+    worker.join();
+    struct uhid_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = UHID_DESTROY;
+    if (write(fd, &ev, sizeof(ev)) != sizeof(ev))
+      fprintf(stderr, "Failed to destroy uhid device\n");
+    close(fd);
+    fd = -1;
+  }
+
+  // opens the hidraw node the kernel made for this device, NULL if it isn't there (yet)
+  ms2109_device* open_hidraw(void) const {
+    std::vector<std::string> nodes;
+    list_hidraw_nodes(nodes);
+    for (const std::string& node : nodes) {
+      std::string value;
+      if (read_sysfs_line("/sys/class/hidraw/" + node.substr(5) + "/device/uevent", "HID_UNIQ=", value) && value == uniq)
+        return open_device(node, true);
+    }
+    return NULL;
+  }
+
+private:
+  void run(void) {
+    while (!quit) {
+      struct pollfd p = { fd, POLLIN, 0 };
+      if (poll(&p, 1, 100) <= 0)
+        continue;
+
+      struct uhid_event ev;
+      if (read(fd, &ev, sizeof(ev)) <= 0)
+        continue;
+
+      feature_report rep = {};
+      struct uhid_event reply;
+      memset(&reply, 0, sizeof(reply));
+      if (ev.type == UHID_SET_REPORT) {
+        memcpy(&rep, ev.u.set_report.data, ev.u.set_report.size < sizeof(rep) ? ev.u.set_report.size : sizeof(rep));
+        reply.type = UHID_SET_REPORT_REPLY;
+        reply.u.set_report_reply.id = ev.u.set_report.id;
+        reply.u.set_report_reply.err = backend.do_set_feature(rep) ? 0 : EIO;
+      }
+      else if (ev.type == UHID_GET_REPORT) {
+        reply.type = UHID_GET_REPORT_REPLY;
+        reply.u.get_report_reply.id = ev.u.get_report.id;
+        if (backend.do_get_feature(rep)) {
+          memcpy(reply.u.get_report_reply.data, &rep, sizeof(rep));
+          reply.u.get_report_reply.size = sizeof(rep);
+        }
+        else reply.u.get_report_reply.err = EIO;
+      }
+      else continue;
+
+      if (write(fd, &reply, sizeof(reply)) != sizeof(reply))
+        fprintf(stderr, "Failed to reply to uhid request\n");
+    }
+  }
+
+  ms2109_transport& backend;
+  std::string uniq;
+  int fd = -1;
+  std::thread worker;
+  std::atomic<bool> quit;
+};
+#endif
+
+/* Builds a plausible unpatched firmware image for the simulator: the usual Patch_Common
+*  prologue followed by filler code, with valid checksums.
+*/
+static std::vector<uint8_t> make_sim_image(uint16_t eeprom_size) {
+  std::vector<uint8_t> image(eeprom_size, 0xFF);
+  uint16_t code_size = eeprom_size > 0x800 ? 0x5A0 : 0x2D0;
+
+  image[0] = eeprom_size > 0x800 ? 0x96 : 0xA5;
+  image[1] = eeprom_size > 0x800 ? 0x69 : 0x5A;
+  image[2] = code_size >> 8;
+  image[3] = (uint8_t)code_size;
+  image[4] = 0x01; // Patch_Common
+  image[5] = 0x10; // hdmi rx edid svc replace
+  image[10] = 0x00;
+  image[11] = 0x00;
+  image[12] = 0x20;
+  image[13] = 0x20;
+  image[14] = 0x05;
+  image[15] = 0x12;
+
+  static const uint8_t prologue[] = { 0x90, 0xC4, 0x00, 0xEF, 0xF0 }; // mov DPTR,#0xC400; mov A,R7; movx @DPTR,A
+  memcpy(&image[0x30], prologue, sizeof(prologue));
+  uint32_t lcg = 0x2109;
+  for (uint16_t i = sizeof(prologue); i < code_size - 1; i++) {
+    lcg = lcg * 1103515245 + 12345;
+    image[0x30 + i] = (uint8_t)(lcg >> 16);
+  }
+  image[0x30 + code_size - 1] = 0x22; // ret
+
+  uint16_t hdr_sum = sum_bytes(&image[2], 0x2E);
+  uint16_t data_sum = sum_bytes(&image[0x30], code_size);
+  image[0x30 + code_size] = hdr_sum >> 8;
+  image[0x31 + code_size] = (uint8_t)hdr_sum;
+  image[0x32 + code_size] = data_sum >> 8;
+  image[0x33 + code_size] = (uint8_t)data_sum;
+  return image;
+}
+
+static BOOLEAN load_file(const char* filename, std::vector<uint8_t>& data) {
+  FILE* f = fopen(filename, "rb");
+  if (f == NULL) {
+    fprintf(stderr, "Failed to open %s\n", filename);
+    return false;
+  }
+  data.clear();
+  uint8_t buf[4096];
+  size_t len;
+  while ((len = fread(buf, 1, sizeof(buf), f)) > 0)
+    data.insert(data.end(), buf, buf + len);
+  fclose(f);
+  return true;
+}
+
+// creates the directories a file goes in if they aren't there yet, like mkdir -p (a new account has no ~/.cache)
+static void make_parent_dirs(const std::string& filename) {
+  for (size_t i = 1; i < filename.size(); i++) {
+    if (filename[i] != '/' && filename[i] != '\\')
+      continue;
+    std::string dir = filename.substr(0, i);
+#ifdef _WIN32
+    CreateDirectoryA(dir.c_str(), NULL);
+#else
+    mkdir(dir.c_str(), 0755);
+#endif
+  }
+}
+
+static BOOLEAN save_file(const char* filename, const uint8_t* data, size_t len) {
+  FILE* f = fopen(filename, "wb");
+  if (f == NULL) {
+    fprintf(stderr, "Failed to create %s\n", filename);
+    return false;
+  }
+  BOOLEAN ok = fwrite(data, 1, len, f) == len;
+  if (fclose(f) != 0) ok = false;
+  if (!ok) fprintf(stderr, "Failed to write %s\n", filename);
+  return ok;
+}
+
+/* EEPROM backups are PackBits compressed. They're mostly 0xFF padding, which this squeezes down
+*  to almost nothing without needing a compression library. After the magic and the 32-bit
+*  unpacked size, a header byte n of 0-127 is followed by n + 1 literal bytes and one of 129-255
+*  by a single byte that's repeated 257 - n times.
+*/
+static const uint8_t packed_magic[8] = { 'M', 'S', '2', '1', '0', '9', 'P', 'B' };
+
+static std::vector<uint8_t> pack_image(const uint8_t* data, size_t len) {
+  std::vector<uint8_t> out(packed_magic, packed_magic + 8);
+  for (int shift = 24; shift >= 0; shift -= 8)
+    out.push_back((uint8_t)(len >> shift));
+  size_t i = 0;
+  while (i < len) {
+    size_t run = 1;
+    while (i + run < len && run < 128 && data[i + run] == data[i])
+      run++;
+    if (run >= 2) {
+      out.push_back((uint8_t)(257 - run));
+      out.push_back(data[i]);
+      i += run;
+      continue;
+    }
+    size_t start = i;
+    while (i < len && i - start < 128 && !(i + 1 < len && data[i] == data[i + 1]))
+      i++;
+    out.push_back((uint8_t)(i - start - 1));
+    out.insert(out.end(), data + start, data + i);
+  }
+  return out;
+}
+
+// unpacks data in place if it's a packed image; returns false if it claims to be one but is broken
+static BOOLEAN unpack_image(std::vector<uint8_t>& data) {
+  if (data.size() < 12 || memcmp(data.data(), packed_magic, 8) != 0)
+    return true;
+  size_t len = ((size_t)data[8] << 24) | (data[9] << 16) | (data[10] << 8) | data[11];
+  if (len > 0x1000) // no EEPROM is bigger, anything else is a damaged header
+    return false;
+  std::vector<uint8_t> out;
+  out.reserve(len);
+  size_t i = 12;
+  while (i < data.size() && out.size() < len) {
+    uint8_t n = data[i++];
+    if (n < 128) {
+      if (i + n + 1 > data.size())
+        return false;
+      out.insert(out.end(), &data[i], &data[i] + n + 1);
+      i += n + 1;
+    }
+    else if (n > 128 && i < data.size())
+      out.insert(out.end(), 257 - n, data[i++]);
+    else
+      return false;
+  }
+  if (out.size() != len)
+    return false;
+  data.swap(out);
+  return true;
+}
+
+// load_file() for EEPROM images, which may be packed backups
+static BOOLEAN load_image(const char* filename, std::vector<uint8_t>& data) {
+  if (!load_file(filename, data))
+    return false;
+  if (!unpack_image(data)) {
+    fprintf(stderr, "%s is a damaged EEPROM backup\n", filename);
+    return false;
+  }
+  return true;
+}
+
+/* Copy-on-write mapping of an EEPROM dump: the patcher can modify it in place without the
+*  original file changing, and the result gets saved wherever it's wanted afterwards.
+*/
+class mapped_image {
+public:
+  ~mapped_image() {
+#ifdef _WIN32
+    if (data) UnmapViewOfFile(data);
+    if (mapping) CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+    if (data) munmap(data, size);
+#endif
+  }
+
+  BOOLEAN open(const char* filename) {
+#ifdef _WIN32
+    LARGE_INTEGER len;
+    file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &len) || len.QuadPart == 0) {
+      fprintf(stderr, "Failed to open %s\n", filename);
+      return false;
+    }
+    mapping = CreateFileMapping(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+    if (mapping != NULL)
+      data = (uint8_t*)MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+    size = (size_t)len.QuadPart;
+#else
+    int fd = ::open(filename, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+      fprintf(stderr, "Failed to open %s\n", filename);
+      if (fd >= 0) close(fd);
+      return false;
+    }
+    size = (size_t)st.st_size;
+    void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p != MAP_FAILED)
+      data = (uint8_t*)p;
+#endif
+    if (data == NULL)
+      fprintf(stderr, "Failed to map %s\n", filename);
+    return data != NULL;
+  }
+
+  uint8_t* data = NULL;
+  size_t size = 0;
+
+private:
+#ifdef _WIN32
+  HANDLE file = INVALID_HANDLE_VALUE;
+  HANDLE mapping = NULL;
+#endif
+};
+
+/* Remembers patched devices between runs so they can be skipped without identifying them all
+*  over again. It's a text file with one line per device:
+*   <instance ID> <version> <EEPROM size> <code size>
+*  Only devices this program has looked at get updated, the rest are kept as they were.
+*/
+class fingerprint_cache {
+public:
+  BOOLEAN load(const char* filename) {
+    FILE* f = fopen(filename, "r");
+    if (f == NULL)
+      return false;
+    char line[512], instance[400];
+    while (fgets(line, sizeof(line), f)) {
+      device_fingerprint fp;
+      unsigned version, eeprom_size, code_size;
+      if (line[0] == '#' || sscanf(line, "%399s %x %x %x", instance, &version, &eeprom_size, &code_size) != 4)
+        continue;
+      if (eeprom_size != 0x800 && eeprom_size != 0x1000)
+        continue;
+      fp.version = version;
+      fp.eeprom_size = (uint16_t)eeprom_size;
+      fp.code_size = (uint16_t)code_size;
+      entries[instance] = fp;
+    }
+    fclose(f);
+    return true;
+  }
+
+  BOOLEAN save(const char* filename) const {
+    std::string text = "# instance version eeprom_size code_size\n";
+    for (auto& e : entries) {
+      char line[64];
+      snprintf(line, sizeof(line), " %08X %04X %04X\n", e.second.version, e.second.eeprom_size, e.second.code_size);
+      text += e.first + line;
+    }
+    return save_file(filename, (const uint8_t*)text.data(), text.size());
+  }
+
+  const device_fingerprint* find(const std::string& instance) const {
+    auto it = entries.find(instance);
+    return it == entries.end() ? NULL : &it->second;
+  }
+  void update(const std::string& instance, const device_fingerprint& fp) { entries[instance] = fp; }
+  void forget(const std::string& instance) { entries.erase(instance); }
+
+private:
+  std::map<std::string, device_fingerprint> entries;
+};
+
+// the user's cache directory (%LOCALAPPDATA% on Windows, $XDG_CACHE_HOME or ~/.cache elsewhere)
+// with a trailing separator, or "" if there doesn't seem to be one
+static std::string default_cache_dir(void) {
+  const char* dir = getenv("LOCALAPPDATA");
+  if (dir)
+    return std::string(dir) + "\\";
+  else if ((dir = getenv("XDG_CACHE_HOME")) != NULL && *dir)
+    return std::string(dir) + "/";
+  else if ((dir = getenv("HOME")) != NULL)
+    return std::string(dir) + "/.cache/";
+  return "";
+}
+
+// the temp directory with a trailing separator, for files nobody needs to find again
+static std::string default_temp_dir(void) {
+#ifdef _WIN32
+  char dir[MAX_PATH + 1];
+  DWORD len = GetTempPathA(sizeof(dir), dir);
+  return len && len < sizeof(dir) ? std::string(dir, len) : "";
+#else
+  const char* dir = getenv("TMPDIR");
+  return std::string(dir && *dir ? dir : "/tmp") + "/";
+#endif
+}
+
+static std::string default_cache_file(void) {
+  std::string dir = default_cache_dir();
+  return dir.empty() ? "" : dir + "ms2109_stereo_fix.cache";
+}
+
+template <class c>
+static BOOLEAN read_eeprom(ms2109_device& dev, uint16_t address, c& val) {
+  if (address >= dev.max_eeprom_address) return false;
+  feature_report rep = {};
+  rep.report_id = 0;
+  rep.cmd = 0xE5;
+  rep.address_hi = (uint8_t)(address >> 8);
+  rep.address_lo = (uint8_t)address;
+  rep.data[4] = dev.max_eeprom_address >> 12;
+  if (dev.transport->set_feature(rep)) {
+    if (dev.transport->get_feature(rep)) {
+      val = 0;
+      for (int i = 0; i < sizeof(c); i++) {
+        val = (val << 8) | rep.data[i];
+      }
+      return true;
+    }
+    else dev_printf(dev, "Failed to read EEPROM @ %04X\n", address);
+  }
+  else dev_printf(dev, "Failed to set EEPROM read address %04X\n", address);
+  return false;
+}
+
+static BOOLEAN read_eeprom_byte(ms2109_device& dev, uint16_t address, uint8_t& val) {
+  return read_eeprom(dev, address, val);
+}
+
+static BOOLEAN read_eeprom_word(ms2109_device& dev, uint16_t address, uint16_t& val) {
+  return read_eeprom(dev, address, val);
+}
+
+static BOOLEAN read_eeprom_dword(ms2109_device& dev, uint16_t address, uint32_t& val) {
+  return read_eeprom(dev, address, val);
+}
+
+/* Each E5 response carries 4 consecutive EEPROM bytes (that's how read_eeprom_dword works),
+*  but B5 responses only have one valid XDATA byte in data[0].
+*/
+#define EEPROM_READ_CHUNK 4
+#define XDATA_READ_CHUNK  1
+
+/* Reads a block of EEPROM as a single batch, using every byte of each response. Going through
+*  read_eeprom_word this takes half as many round trips per byte as the 16-bit values need
+*  and every one is issued separately.
+*/
+static void make_eeprom_reads(ms2109_device& dev, uint16_t address, size_t len, std::vector<feature_report>& reps) {
+  size_t count = (len + EEPROM_READ_CHUNK - 1) / EEPROM_READ_CHUNK;
+  reps.assign(count, feature_report());
+  for (size_t i = 0; i < count; i++) {
+    uint16_t a = (uint16_t)(address + i * EEPROM_READ_CHUNK);
+    reps[i].cmd = 0xE5;
+    reps[i].address_hi = (uint8_t)(a >> 8);
+    reps[i].address_lo = (uint8_t)a;
+    reps[i].data[4] = dev.max_eeprom_address >> 12;
+  }
+}
+
+static BOOLEAN read_eeprom_range(ms2109_device& dev, uint16_t address, uint8_t* buf, size_t len) {
+  if (address + len > dev.max_eeprom_address) return false;
+  std::vector<feature_report> reps;
+  make_eeprom_reads(dev, address, len, reps);
+  size_t count = reps.size();
+  size_t done = dev.transport->transact(reps.data(), count);
+  if (done < count) {
+    dev_printf(dev, "Failed to read EEPROM @ %04X\n", (unsigned)(address + done * EEPROM_READ_CHUNK));
+    return false;
+  }
+  for (size_t i = 0; i < len; i++)
+    buf[i] = reps[i / EEPROM_READ_CHUNK].data[i % EEPROM_READ_CHUNK];
+  return true;
+}
+
+// reads the entire EEPROM into memory
+static BOOLEAN read_eeprom_snapshot(ms2109_device& dev, std::vector<uint8_t>& image) {
+  image.resize(dev.max_eeprom_address);
+  return read_eeprom_range(dev, 0, image.data(), image.size());
+}
+
+static BOOLEAN write_eeprom_byte(ms2109_device& dev, uint16_t address, uint8_t src) {
+  if (address >= dev.max_eeprom_address) return false;
+  feature_report rep = {};
+  rep.report_id = 0;
+  rep.cmd = 0xE6;
+  rep.address_hi = (uint8_t)(address >> 8);
+  rep.address_lo = (uint8_t)address;
+  rep.data[0] = src;
+  rep.data[4] = dev.max_eeprom_address >> 12;
+  if (dev.transport->set_feature(rep)) {
+    // a busy EEPROM reads as 0xFF, so keep reading until the write cycle is over
+    auto timeout = trace_clock::now() + std::chrono::milliseconds(20);
+    uint8_t d;
+    do {
+      if (!read_eeprom_byte(dev, address, d))
+        return false;
+    } while (d != src && trace_clock::now() < timeout);
+    if (d != src) {
+      dev_printf(dev, "Failed to verify EEPROM @ %04X after writing (expected %02X actual %02X)\n", address, src, d);
+      return false;
+    }
+    return true;
+  }
+  else dev_printf(dev, "Failed to write EEPROM @ %04X\n", address);
+  return false;
+}
+
+/* Collects EEPROM writes and sends them as one batch when flushed, then checks everything that
+*  was written with a bulk read-back instead of reading each byte back straight after writing it.
+*  flush() is a barrier: nothing queued after it can reach the EEPROM until everything before it
+*  has been written and verified, which is what keeps the checksums -> data size -> opcode
+*  ordering in plan_image_changes() crash-safe.
+*/
+class eeprom_writer {
+public:
+  eeprom_writer(ms2109_device& d) : dev(d) {}
+
+  void write_byte(uint16_t address, uint8_t val) { pending[address] = val; }
+  void write_word(uint16_t address, uint16_t val) {
+    write_byte(address, (uint8_t)(val >> 8));
+    write_byte(address + 1, (uint8_t)val);
+  }
+  void write(uint16_t address, const uint8_t* src, size_t len) {
+    for (size_t i = 0; i < len; i++)
+      write_byte((uint16_t)(address + i), src[i]);
+  }
+
+  BOOLEAN flush(void) {
+    std::map<uint16_t, uint8_t> writes;
+    writes.swap(pending);
+    if (writes.empty()) return true;
+
+    if (dev.verify_each_write) {
+      for (auto& w : writes) {
+        if (!write_eeprom_byte(dev, w.first, w.second))
+          return false;
+      }
+      return true;
+    }
+
+    /* A write sent while the EEPROM is still busy with the previous one is silently dropped, so
+    *  writes are paced by the measured write cycle time. Anything that still didn't stick shows up
+    *  in the read-back and gets written again with a more conservative pace.
+    */
+    for (unsigned attempt = 0; ; attempt++) {
+      if (!write_paced(writes))
+        return false;
+
+      std::map<uint16_t, uint8_t> failed;
+      if (!verify(writes, failed))
+        return false;
+      if (failed.empty())
+        return true;
+
+      if (attempt == WRITE_RETRIES) {
+        for (auto& f : failed)
+          dev_printf(dev, "Failed to verify EEPROM @ %04X after writing (expected %02X)\n", f.first, f.second);
+        return false;
+      }
+      dev_printf(dev, "%u EEPROM write(s) didn't stick, retrying more slowly\n", (unsigned)failed.size());
+      // no more timing after this, it would average the slower pace straight back down
+      dev.write_cycle_us = dev.write_cycle_us * 2 + 1000;
+      if (dev.write_cycle_samples < WRITE_CYCLE_CALIBRATION)
+        dev.write_cycle_samples = WRITE_CYCLE_CALIBRATION;
+      writes.swap(failed);
+    }
+  }
+
+private:
+  static const unsigned WRITE_RETRIES = 2;
+  // the first few writes are timed by polling until they read back, after that they are just paced
+  static const unsigned WRITE_CYCLE_CALIBRATION = 4;
+  // no serial EEPROM takes longer than this, give up polling and let the read-back catch it
+  static const unsigned WRITE_CYCLE_TIMEOUT_US = 20000;
+  // the longest write cycle in 24Cxx datasheets, used until there's a measurement to go on
+  static const unsigned UNTIMED_WRITE_CYCLE_US = 5000;
+
+  BOOLEAN write_paced(const std::map<uint16_t, uint8_t>& writes) {
+    for (auto& w : writes) {
+      if (w.first >= dev.max_eeprom_address) return false;
+      feature_report rep = {};
+      rep.cmd = 0xE6;
+      rep.address_hi = (uint8_t)(w.first >> 8);
+      rep.address_lo = (uint8_t)w.first;
+      rep.data[0] = w.second;
+      rep.data[4] = dev.max_eeprom_address >> 12;
+
+      wait_until(last_write + pace());
+      if (dev.transport->transact(&rep, 1) != 1) {
+        dev_printf(dev, "Failed to write EEPROM @ %04X\n", w.first);
+        return false;
+      }
+      last_write = trace_clock::now();
+
+      // a busy EEPROM reads as 0xFF, so writes of 0xFF can't be timed
+      if (dev.write_cycle_samples < WRITE_CYCLE_CALIBRATION && w.second != 0xFF) {
+        if (!time_write(w.first, w.second))
+          return false;
+      }
+    }
+    // let the last write finish before anything reads it back
+    wait_until(last_write + pace());
+    return true;
+  }
+
+  BOOLEAN time_write(uint16_t address, uint8_t val) {
+    auto timeout = last_write + std::chrono::microseconds((long long)WRITE_CYCLE_TIMEOUT_US);
+    for (;;) {
+      trace_clock::time_point start = trace_clock::now();
+      uint8_t d;
+      if (!read_eeprom_byte(dev, address, d))
+        return false;
+      if (d == val) {
+        double us = std::chrono::duration<double, std::micro>(start - last_write).count();
+        dev.write_cycle_us = dev.write_cycle_samples ? dev.write_cycle_us * 0.75 + us * 0.25 : us;
+        dev.write_cycle_samples++;
+        last_write = start;
+        return true;
+      }
+      if (start >= timeout)
+        return true;
+    }
+  }
+
+  std::chrono::microseconds pace(void) const {
+    if (dev.write_cycle_samples == 0)
+      return std::chrono::microseconds((long long)UNTIMED_WRITE_CYCLE_US);
+    // a 25% margin over the average, since some cells take longer than others
+    return std::chrono::microseconds((long long)(dev.write_cycle_us * 1.25));
+  }
+
+  // read back runs of written bytes, bridging small gaps since every read returns several bytes anyway
+  BOOLEAN verify(const std::map<uint16_t, uint8_t>& writes, std::map<uint16_t, uint8_t>& failed) {
+    auto it = writes.begin();
+    while (it != writes.end()) {
+      uint16_t start = it->first, end = it->first;
+      auto run_end = it;
+      for (++run_end; run_end != writes.end() && run_end->first - end <= EEPROM_READ_CHUNK; ++run_end)
+        end = run_end->first;
+
+      std::vector<uint8_t> d(end - start + 1);
+      if (!read_eeprom_range(dev, start, d.data(), d.size()))
+        return false;
+      for (; it != run_end; ++it) {
+        if (d[it->first - start] != it->second)
+          failed[it->first] = it->second;
+      }
+    }
+    return true;
+  }
+
+  trace_clock::time_point last_write;
+  ms2109_device& dev;
+  std::map<uint16_t, uint8_t> pending;
+};
+
+static BOOLEAN read_xdata_byte(ms2109_device& dev, uint16_t address, uint8_t& val) {
+  feature_report rep = {};
+  rep.report_id = 0;
+  rep.cmd = 0xB5;
+  rep.address_hi = (uint8_t)(address >> 8);
+  rep.address_lo = (uint8_t)address;
+  if (dev.transport->set_feature(rep)) {
+    if (dev.transport->get_feature(rep)) {
+      val = rep.data[0];
+      return true;
+    }
+    else dev_printf(dev, "Failed to read XDATA @ %04X\n", address);
+  }
+  else dev_printf(dev, "Failed to set XDATA read address %04X\n", address);
+  return false;
+}
+
+static BOOLEAN read_xdata_range(ms2109_device& dev, uint16_t address, uint8_t* buf, size_t len) {
+  if (address + len > 0x10000) return false;
+  size_t count = (len + XDATA_READ_CHUNK - 1) / XDATA_READ_CHUNK;
+  std::vector<feature_report> reps(count);
+  for (size_t i = 0; i < count; i++) {
+    uint16_t a = (uint16_t)(address + i * XDATA_READ_CHUNK);
+    reps[i].cmd = 0xB5;
+    reps[i].address_hi = (uint8_t)(a >> 8);
+    reps[i].address_lo = (uint8_t)a;
+  }
+  size_t done = dev.transport->transact(reps.data(), count);
+  if (done < count) {
+    dev_printf(dev, "Failed to read XDATA @ %04X\n", (unsigned)(address + done * XDATA_READ_CHUNK));
+    return false;
+  }
+  for (size_t i = 0; i < len; i++)
+    buf[i] = reps[i / XDATA_READ_CHUNK].data[i % XDATA_READ_CHUNK];
+  return true;
+}
+
+static BOOLEAN read_xdata_word(ms2109_device& dev, uint16_t address, uint16_t& val) {
+  uint8_t d[2];
+  if (read_xdata_range(dev, address, d, 2)) {
+    val = (d[0] << 8) | d[1];
+    return true;
+  }
+  return false;
+}
+
+static BOOLEAN write_xdata_byte(ms2109_device& dev, uint16_t address, uint8_t val) {
+  feature_report rep = {};
+  rep.report_id = 0;
+  rep.cmd = 0xB6;
+  rep.address_hi = (uint8_t)(address >> 8);
+  rep.address_lo = (uint8_t)address;
+  rep.data[0] = val;
+  if (dev.transport->set_feature(rep)) {
+    return true;
+  }
+  else dev_printf(dev, "Failed to write XDATA %04X\n", address);
+  return false;
+}
+
+// reads a set of (not necessarily adjacent) XDATA bytes as one batch
+static BOOLEAN read_xdata_bytes(ms2109_device& dev, const uint16_t* addresses, uint8_t* vals, size_t count) {
+  std::vector<feature_report> reps(count);
+  for (size_t i = 0; i < count; i++) {
+    reps[i].cmd = 0xB5;
+    reps[i].address_hi = (uint8_t)(addresses[i] >> 8);
+    reps[i].address_lo = (uint8_t)addresses[i];
+  }
+  size_t done = dev.transport->transact(reps.data(), count);
+  if (done < count) {
+    dev_printf(dev, "Failed to read XDATA @ %04X\n", addresses[done]);
+    return false;
+  }
+  for (size_t i = 0; i < count; i++)
+    vals[i] = reps[i].data[0];
+  return true;
+}
+
+// writes a set of (not necessarily adjacent) XDATA bytes as one batch, in the order given
+static BOOLEAN write_xdata_bytes(ms2109_device& dev, const uint16_t* addresses, const uint8_t* vals, size_t count) {
+  std::vector<feature_report> reps(count);
+  for (size_t i = 0; i < count; i++) {
+    reps[i].cmd = 0xB6;
+    reps[i].address_hi = (uint8_t)(addresses[i] >> 8);
+    reps[i].address_lo = (uint8_t)addresses[i];
+    reps[i].data[0] = vals[i];
+  }
+  size_t done = dev.transport->transact(reps.data(), count);
+  if (done < count) {
+    dev_printf(dev, "Failed to write XDATA %04X\n", addresses[done]);
+    return false;
+  }
+  return true;
+}
+
+static BOOLEAN has_mono_descriptor(ms2109_device& dev) {
+  static const uint16_t addresses[] = { 0xC4C5, 0xC4C9, 0xC4CA, 0xC4CB };
+  uint8_t d[4];
+
+  if (!read_xdata_bytes(dev, addresses, d, 4)) {
+    dev_printf(dev, "Failed to read audio format descriptor\n");
+    return false;
+  }
+  uint8_t audio_format_channels = d[0];
+  const uint8_t* audio_format_rate = d + 1;
+  if (audio_format_channels != 1) {
+    dev_printf(dev, "Audio format channels was not 1 (%d)\n", audio_format_channels);
+    return false;
+  }
+
+  if (audio_format_rate[0] != 0x00 || audio_format_rate[1] != 0x77 || audio_format_rate[2] != 0x01) {
+    dev_printf(dev, "Audio format sampling rate was not 96000 (%d)\n", (audio_format_rate[2] << 16) | (audio_format_rate[1] << 8) | audio_format_rate[0]);
+    return false;
+  }
+
+  return true;
+}
+
+static BOOLEAN identify_eeprom(ms2109_device& dev) {
+  uint16_t d;
+
+  if (dev.eeprom_identified)
+    return true;
+  dev.eeprom_identified = true;
+
+  // check xdata where the EEPROM is mapped first, to figure out what type it is
+  if (read_xdata_word(dev, 0xCBD0, d)) {
+    if (d == 0xA55A)
+      dev.max_eeprom_address = 0x800;
+    else if (d == 0x9669)
+      dev.max_eeprom_address = 0x1000;
+  }
+
+  if (read_eeprom_word(dev, 0, d)) {
+    if (d == 0xA55A && dev.max_eeprom_address == 0x800)
+      return true;
+    if (d == 0x9669 && dev.max_eeprom_address == 0x1000)
+      return true;
+    // eeprom signature didn't match expected signature, try harder...
+  }
+
+  dev.max_eeprom_address = 0x800;
+  if (read_eeprom_word(dev, 0, d) && d == 0xA55A)
+    return true;
+
+  dev.max_eeprom_address = 0x1000;
+  if (read_eeprom_word(dev, 0, d) && d == 0x9669)
+    return true;
+
+  dev_printf(dev, "Failed to recognize EEPROM signature (%04X)\n", d);
+  dev.eeprom_identified = false;
+  return false;
+}
+
+static BOOLEAN identify_ms2109(ms2109_device& dev) {
+  static const uint16_t addresses[] = { 0xF800, 0xF801, 0xF802 };
+  uint8_t id[3] = {};
+
+  if (read_xdata_bytes(dev, addresses, id, 3)) {
+    if (id[0] == 0xA7 && id[1] == 0x10 && id[2] == 0x9A)
+      return true;
+  }
+
+  dev_printf(dev, "Failed to identify MS2109 chip (%02X:%02X:%02X)\n", id[0], id[1], id[2]);
+  return false;
+}
+
+
+/* Places in the EEPROM code that patches can be called from. The instruction(s) at the site
+*  get replaced by an LCALL to the patch code and moved to its end, and the site has to look
+*  exactly like this for that to be safe (whole instructions, nothing relative to their address).
+*  The firmware only calls an EEPROM hook function if its bit in header byte 4 or 5 is set.
+*  Only Patch_Common is in here because it's the one hook whose entry point and calling
+*  convention are known (R7 = stage); the others would need their entry points worked out first.
+*/
+struct hook_site {
+  const char* name;
+  uint8_t header_byte, header_bit;
+  uint16_t offset;          // from the start of the code (0xCC00)
+  uint8_t displaced;        // bytes replaced by the LCALL, at least 3
+  uint8_t match[5], mask[5];
+  BOOLEAN starts_with_dptr; // it's the start of a function beginning with "mov DPTR, #i", whose i gets reported
+};
+
+static const hook_site hook_sites[] = {
+  // the first opcodes must be "mov DPTR, #i; mov A,R7; movx @DPTR,A" (5 bytes)
+  { "Patch_Common", 4, 0x01, 0x0000, 3, { 0x90, 0x00, 0x00, 0xEF, 0xF0 }, { 0xFF, 0x00, 0x00, 0xFF, 0xFF }, true },
+};
+
+/* A piece of 8051 code to splice into the EEPROM code, called from a hook site. The displaced
+*  instructions and a RET get appended to it, so jumping to the end of the code (offset
+*  code.size()) carries on with the original firmware. Several patches on the same site are
+*  chained one after the other, each one continuing into the next.
+*  relocs lists the offsets of absolute addresses (LCALL/LJMP/mov DPTR) that point within the
+*  code; they're written relative to the start of the code and get relocated to where it lands.
+*/
+struct code_patch {
+  const char* name;
+  const char* site;
+  std::vector<uint8_t> code;
+  std::vector<uint16_t> relocs;
+};
+
+static const code_patch audio_format_patch = { "audio descriptor", "Patch_Common", {
+    0xEF,             // mov A, R7
+    0xB4, 0x02, 17  , // cjne A, #2, 1f    ; stage 2 = patch the audio format descriptor, else skip everything here
+    0x90, 0xC4, 0xC5, // mov DPTR, #0xC4C5 ; audio format channels byte offset
+    0xF0,             // movx @DPTR, A     ; set channels to 2
+    0x90, 0xC4, 0xC9, // mov DPTR, #0xC4C9 ; audio format sampling rate byte offset
+    0x74, 0x80,       // mov A, #0x80      ; 48000 & 0xFF
+    0xF0,             // movx @DPTR,A
+    0xA3,             // inc DPTR
+    0x74, 0xBB,       // mov A, #0xBB      ; (48000 >> 8) & 0xFF
+    0xF0,             // movx @DPTR,A
+    0xA3,             // inc DPTR
+    0xE4,             // clr A             ; 48000 >> 16
+    0xF0,             // movx @DPTR,A      ; sampling rate = 48000, not 96000
+    // 1:
+  }, {} };
+
+static const code_patch* const default_patches[] = { &audio_format_patch };
+
+static const hook_site* find_hook_site(const char* name) {
+  for (const hook_site& site : hook_sites) {
+    if (!strcmp(site.name, name))
+      return &site;
+  }
+  return NULL;
+}
+
+// code size after adding the patches (and keeping the old checksums), or -1 for an unknown hook site
+static int patched_code_size(uint16_t data_size, const code_patch* const* patches, size_t count) {
+  int size = data_size + 4;
+  for (const hook_site& site : hook_sites) {
+    int used = 0;
+    for (size_t i = 0; i < count; i++) {
+      if (!strcmp(patches[i]->site, site.name))
+        used += (int)patches[i]->code.size();
+    }
+    if (used) size += used + site.displaced + 1;
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (!find_hook_site(patches[i]->site))
+      return -1;
+  }
+  return size;
+}
+
+static BOOLEAN site_used(const hook_site& site, const code_patch* const* patches, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    if (!strcmp(patches[i]->site, site.name))
+      return true;
+  }
+  return false;
+}
+
+// checks the first 5 bytes of a hook site are what the patch expects to displace
+static BOOLEAN check_hook_site(ms2109_device& dev, const hook_site& site, const uint8_t* at) {
+  for (int j = 0; j < 5; j++) {
+    if ((at[j] & site.mask[j]) != site.match[j]) {
+      dev_printf(dev, "Unexpected bytestream at %s, don't know how to patch this: %02X%02X%02X%02X%02X\n",
+        site.name, at[0], at[1], at[2], at[3], at[4]);
+      if (at[0] == 0x12)
+        dev_printf(dev, "This device may have already been patched.\n");
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Applies a set of patches to an image in memory, which has to be big enough for the patched
+*  code and sums. The old checksums are kept as part of the code - if the patch is interrupted
+*  they're still valid for as long as possible - followed by the patches, one block per hook
+*  site, then the new checksums. Both sums are worked out once at the end.
+*/
+static int build_patched_image(ms2109_device& dev, std::vector<uint8_t>& image, uint16_t data_size,
+  const code_patch* const* patches, size_t count) {
+  uint16_t hdr_sum = (image[data_size + 0x30] << 8) | image[data_size + 0x31];
+  uint16_t data_sum = (image[data_size + 0x32] << 8) | image[data_size + 0x33];
+
+  /* The patch is built on top of the existing sums, so if they're already wrong the result
+  *  will be too. Warn but carry on - the firmware may not check them as strictly as we do.
+  */
+  uint16_t hdr_error = hdr_sum - sum_bytes(&image[2], 0x2E);
+  uint16_t data_error = data_sum - sum_bytes(&image[0x30], data_size);
+  if (hdr_error != 0)
+    dev_printf(dev, "WARNING: header checksum is incorrect (stored %04X, calculated %04X)\n", hdr_sum, (uint16_t)(hdr_sum - hdr_error));
+  if (data_error != 0)
+    dev_printf(dev, "WARNING: data checksum is incorrect (stored %04X, calculated %04X)\n", data_sum, (uint16_t)(data_sum - data_error));
+
+  uint16_t end = data_size + 4;
+  for (const hook_site& site : hook_sites) {
+    uint8_t* at = &image[0x30 + site.offset];
+    uint16_t load = 0xCC00 + end;
+    BOOLEAN used = false;
+    for (size_t i = 0; i < count; i++) {
+      const code_patch& patch = *patches[i];
+      if (strcmp(patch.site, site.name))
+        continue;
+      if (!used) {
+        if (!check_hook_site(dev, site, at))
+          return -9;
+        if (site.starts_with_dptr)
+          dev_printf(dev, "Found %s start, DPTR immediate is %04X\n", site.name, (at[1] << 8) | at[2]);
+        used = true;
+      }
+
+      dev_printf(dev, "Adding %s patch code at %04X\n", patch.name, 0xCC00 + end);
+      uint8_t* code = &image[0x30 + end];
+      memcpy(code, patch.code.data(), patch.code.size());
+      for (uint16_t r : patch.relocs) {
+        uint16_t target = ((code[r] << 8) | code[r + 1]) + 0xCC00 + end;
+        code[r] = target >> 8;
+        code[r + 1] = (uint8_t)target;
+      }
+      end += (uint16_t)patch.code.size();
+    }
+    if (!used)
+      continue;
+
+    // the original instructions, then back to the firmware
+    memcpy(&image[0x30 + end], at, site.displaced);
+    end += site.displaced;
+    image[0x30 + end++] = 0x22; // ret
+
+    at[0] = 0x12; // lcall
+    at[1] = load >> 8;
+    at[2] = (uint8_t)load;
+    for (int j = 3; j < site.displaced; j++)
+      at[j] = 0x00; // nop
+    if (!(image[site.header_byte] & site.header_bit)) {
+      dev_printf(dev, "Enabling %s hook\n", site.name);
+      image[site.header_byte] |= site.header_bit;
+    }
+  }
+
+  image[2] = end >> 8;
+  image[3] = (uint8_t)end;
+  hdr_sum = sum_bytes(&image[2], 0x2E) + hdr_error;
+  data_sum = sum_bytes(&image[0x30], end) + data_error;
+  dev_printf(dev, "New code size %04X bytes, header checksum %04X, data checksum %04X\n", end, hdr_sum, data_sum);
+  image[end + 0x30] = hdr_sum >> 8;
+  image[end + 0x31] = (uint8_t)hdr_sum;
+  image[end + 0x32] = data_sum >> 8;
+  image[end + 0x33] = (uint8_t)data_sum;
+  return 0;
+}
+
+/* One byte of a planned EEPROM update. The phases get written in order, so that the window
+*  where the EEPROM is invalid stays as small as possible: first everything outside the area
+*  the current checksums cover (new code, new checksums), then the data size, then whatever
+*  changed inside the old header and code.
+*/
+enum { PHASE_OUTSIDE, PHASE_COMMIT, PHASE_INSIDE, PHASE_COUNT };
+static const char* const phase_names[PHASE_COUNT] = { "outside", "commit", "inside" };
+
+struct planned_write {
+  uint16_t address;
+  uint8_t old_val;
+  uint8_t new_val;
+  unsigned phase;
+};
+
+/* Plans writing the bytes of target that differ from current. current_size is the current code
+*  size, or -1 if the current image isn't valid anyway; then the signature gets written last
+*  instead of the data size.
+*/
+static std::vector<planned_write> plan_image_changes(const uint8_t* current, const uint8_t* target, size_t len, int current_size) {
+  size_t active_end = current_size < 0 ? 0 : (size_t)current_size + 0x34;
+  size_t commit_start = current_size < 0 ? 0 : 2; // bytes that switch to the new image
+  size_t commit_end = commit_start + 2;
+
+  std::vector<planned_write> writes;
+  for (unsigned phase = 0; phase < PHASE_COUNT; phase++) {
+    for (size_t a = 0; a < len; a++) {
+      if (current[a] == target[a])
+        continue;
+      unsigned p = a >= commit_start && a < commit_end ? PHASE_COMMIT : a >= active_end ? PHASE_OUTSIDE : PHASE_INSIDE;
+      if (p == phase)
+        writes.push_back({ (uint16_t)a, current[a], target[a], p });
+    }
+  }
+  return writes;
+}
+
+/* The journal is a small text file in the cache directory, one per device:
+*    ms2109-journal <instance> <EEPROM size> <patch|flash>
+*    write <address> <old> <new> <phase>    one line per planned byte, in the order they get written
+*    done <phase>                           appended as each phase is finished
+*  It reaches the disk before the first EEPROM write and is removed after the last one.
+*/
+static BOOLEAN sync_file(FILE* f) {
+  if (fflush(f) != 0)
+    return false;
+#ifdef _WIN32
+  return _commit(_fileno(f)) == 0;
+#else
+  return fsync(fileno(f)) == 0;
+#endif
+}
+
+// dir/ms2109_<instance><suffix>, with anything in the instance ID that a filename can't have replaced
+static std::string device_file_name(const char* dir, const std::string& instance, const char* suffix) {
+  std::string name(dir);
+  name += "ms2109_";
+  for (char c : instance)
+    name += isalnum((unsigned char)c) ? c : '_';
+  return name + suffix;
+}
+
+static BOOLEAN save_journal(ms2109_device& dev, const char* what, const std::vector<planned_write>& writes) {
+  make_parent_dirs(dev.journal_file);
+  FILE* f = fopen(dev.journal_file.c_str(), "w");
+  if (!f)
+    return false;
+  std::string instance = dev.instance ? narrow(dev.instance) : "-";
+  fprintf(f, "ms2109-journal %s %04X %s\n", instance.c_str(), dev.max_eeprom_address, what);
+  for (const planned_write& w : writes)
+    fprintf(f, "write %04X %02X %02X %s\n", w.address, w.old_val, w.new_val, phase_names[w.phase]);
+  BOOLEAN ok = sync_file(f);
+  if (fclose(f) != 0) ok = false;
+  if (!ok) remove(dev.journal_file.c_str());
+  return ok;
+}
+
+static void journal_phase_done(ms2109_device& dev, unsigned phase) {
+  FILE* f = fopen(dev.journal_file.c_str(), "a");
+  if (!f)
+    return;
+  fprintf(f, "done %s\n", phase_names[phase]);
+  sync_file(f);
+  fclose(f);
+}
+
+static BOOLEAN journal_pending(ms2109_device& dev) {
+  if (dev.journal_file.empty())
+    return false;
+  FILE* f = fopen(dev.journal_file.c_str(), "r");
+  if (!f)
+    return false;
+  fclose(f);
+  return true;
+}
+
+static int find_phase(const char* name) {
+  for (int i = 0; i < PHASE_COUNT; i++) {
+    if (!strcmp(name, phase_names[i]))
+      return i;
+  }
+  return -1;
+}
+
+// returns false if the journal can't be read or doesn't make sense
+static BOOLEAN load_journal(ms2109_device& dev, std::string& what, uint16_t& eeprom_size, std::vector<planned_write>& writes, BOOLEAN* phase_done) {
+  FILE* f = fopen(dev.journal_file.c_str(), "r");
+  if (!f)
+    return false;
+  char magic[32], instance[256], kind[16];
+  unsigned size;
+  BOOLEAN ok = fscanf(f, "%31s %255s %x %15s", magic, instance, &size, kind) == 4 && !strcmp(magic, "ms2109-journal")
+    && (size == 0x800 || size == 0x1000);
+  char tag[16], phase[16];
+  while (ok && fscanf(f, "%15s", tag) == 1) {
+    unsigned address, old_val, new_val;
+    if (!strcmp(tag, "write") && fscanf(f, "%x %x %x %15s", &address, &old_val, &new_val, phase) == 4
+      && address < size && old_val <= 0xFF && new_val <= 0xFF && find_phase(phase) >= 0)
+      writes.push_back({ (uint16_t)address, (uint8_t)old_val, (uint8_t)new_val, (unsigned)find_phase(phase) });
+    else if (!strcmp(tag, "done") && fscanf(f, "%15s", phase) == 1 && find_phase(phase) >= 0)
+      phase_done[find_phase(phase)] = true;
+    else
+      ok = false;
+  }
+  fclose(f);
+  what = kind;
+  eeprom_size = (uint16_t)size;
+  return ok;
+}
+
+/* Carries out planned writes one phase at a time, recording each finished phase in the journal
+*  if there is one and removing it at the end. Returns how many bytes were written.
+*/
+static int run_planned_writes(ms2109_device& dev, const std::vector<planned_write>& writes, BOOLEAN journal) {
+  static const int errors[PHASE_COUNT] = { -10, -13, -14 };
+  for (unsigned phase = 0; phase < PHASE_COUNT; phase++) {
+    eeprom_writer writer(dev);
+    size_t count = 0;
+    for (const planned_write& w : writes) {
+      if (w.phase == phase)
+        writer.write_byte(w.address, w.new_val), count++;
+    }
+    if (count == 0)
+      continue;
+    // DANGER: from the commit phase on until the end the checksums may be incorrect
+    if (!writer.flush())
+      return errors[phase];
+    if (journal)
+      journal_phase_done(dev, phase);
+  }
+  if (journal)
+    remove(dev.journal_file.c_str());
+  return (int)writes.size();
+}
+
+/* Writes the bytes of target that differ from current (see plan_image_changes()), journalling
+*  them first when the device has a journal file. what is "patch" or "flash", for the journal.
+*  Returns how many bytes were written.
+*/
+static int write_image_changes(ms2109_device& dev, const uint8_t* current, const uint8_t* target, size_t len, int current_size, const char* what) {
+  std::vector<planned_write> writes = plan_image_changes(current, target, len, current_size);
+  BOOLEAN journal = false;
+  if (!dev.journal_file.empty() && !writes.empty()) {
+    journal = save_journal(dev, what, writes);
+    if (!journal)
+      dev_printf(dev, "Couldn't write the journal %s, carrying on without one\n", dev.journal_file.c_str());
+  }
+  return run_planned_writes(dev, writes, journal);
+}
+
+/* Finishes the writes of a run that got interrupted. Every planned byte should read back as its
+*  old or its new value, except for at most one that was being written when the device went away.
+*  Anything else means the EEPROM has been changed some other way since and it's left alone.
+*/
+static int resume_journal(ms2109_device& dev, std::string& what) {
+  uint16_t eeprom_size;
+  std::vector<planned_write> writes;
+  BOOLEAN phase_done[PHASE_COUNT] = {};
+  if (!load_journal(dev, what, eeprom_size, writes, phase_done)) {
+    dev_printf(dev, "Journal %s is damaged; delete it if the device works, or --flash a backup\n", dev.journal_file.c_str());
+    return -16;
+  }
+  // it has to be the same EEPROM, whose signature can only be unreadable if it was being rewritten
+  BOOLEAN rewrites_signature = false;
+  for (const planned_write& w : writes)
+    rewrites_signature |= w.address < 2;
+  if (identify_eeprom(dev) ? dev.max_eeprom_address != eeprom_size : !rewrites_signature) {
+    dev_printf(dev, "EEPROM isn't the %u byte one the interrupted %s in %s was for, not touching it.\n"
+      "Delete the journal if the device works, or --flash a backup\n", eeprom_size, what.c_str(), dev.journal_file.c_str());
+    return -16;
+  }
+  dev.max_eeprom_address = eeprom_size;
+  dev.eeprom_identified = true;
+
+  size_t end = 0;
+  for (const planned_write& w : writes)
+    end = std::max(end, (size_t)w.address + 1);
+  std::vector<uint8_t> current(end);
+  if (end && !read_eeprom_range(dev, 0, current.data(), end))
+    return -5;
+
+  std::vector<planned_write> remaining;
+  unsigned torn = 0, unexpected = 0;
+  for (const planned_write& w : writes) {
+    uint8_t val = current[w.address];
+    if (val == w.new_val)
+      continue;
+    if (phase_done[w.phase]) unexpected++;
+    else if (val != w.old_val) torn++;
+    remaining.push_back(w);
+  }
+  if (unexpected || torn > 1) {
+    dev_printf(dev, "EEPROM doesn't match the interrupted %s in %s (%u unexpected bytes), not touching it.\n"
+      "Delete the journal if the device works, or --flash a backup\n", what.c_str(), dev.journal_file.c_str(), unexpected + torn);
+    return -16;
+  }
+
+  dev_printf(dev, "Finishing an interrupted %s: %u of %u bytes still to write\n", what.c_str(), (unsigned)remaining.size(), (unsigned)writes.size());
+  int ret = run_planned_writes(dev, remaining, true);
+  if (ret < 0)
+    return ret;
+  dev_printf(dev, "\n\n%s is complete!\n", what == "flash" ? "Flashing" : "Patching");
+  return 0;
+}
+
+static int attempt_patch(ms2109_device& dev) {
+  const code_patch* const* patches = default_patches;
+  const size_t count = sizeof(default_patches) / sizeof(default_patches[0]);
+  uint16_t data_size;
+
+  if (!identify_eeprom(dev))
+    return -3;
+
+  if (!read_eeprom_word(dev, 2, data_size) || data_size < 5) {
+    dev_printf(dev, "Invalid data size found: %04X\n", data_size);
+    return -4;
+  }
+  dev_printf(dev, "Current data size: %04X bytes\n", data_size);
+
+  int new_size = patched_code_size(data_size, patches, count);
+  if (new_size < 0) {
+    dev_printf(dev, "Patch uses an unknown hook site\n");
+    return -8;
+  }
+  // header size (0x30) + code + new checksums
+  if (new_size + 0x34 > dev.max_eeprom_address) {
+    dev_printf(dev, "Current data size is too large to fit the patches\n");
+    return -7;
+  }
+
+  // an already patched or unknown firmware gets turned away before reading all of it
+  for (const hook_site& site : hook_sites) {
+    uint8_t at[5];
+    if (!site_used(site, patches, count))
+      continue;
+    if (site.offset + 5 > data_size || !read_eeprom_range(dev, 0x30 + site.offset, at, 5))
+      return -5;
+    if (!check_hook_site(dev, site, at))
+      return -9;
+  }
+
+  // header, code, both checksums and the space the patches go in
+  std::vector<uint8_t> image(new_size + 0x34);
+  if (!read_eeprom_range(dev, 0, image.data(), image.size())) {
+    return -5;
+  }
+
+  dev.fingerprint.version = (image[12] << 24) | (image[13] << 16) | (image[14] << 8) | image[15];
+  dev.fingerprint.eeprom_size = dev.max_eeprom_address;
+
+  std::vector<uint8_t> target(image);
+  int ret = build_patched_image(dev, target, data_size, patches, count);
+  if (ret != 0)
+    return ret;
+
+  // patch code and new checksums first, then the data size, then the hook sites
+  ret = write_image_changes(dev, image.data(), target.data(), image.size(), data_size, "patch");
+  if (ret < 0)
+    return ret;
+  dev_printf(dev, "Wrote %d bytes\n", ret);
+  dev.fingerprint.code_size = (target[2] << 8) | target[3];
+  dev.fingerprint_valid = true;
+
+  dev_printf(dev, "\n\nPatching is complete!\n");
+  return 0;
+}
+
+
+// returns the code size if the image has a signature and both checksums are correct, -1 otherwise
+static int check_image(const uint8_t* image, size_t len) {
+  if (len < 0x34 || !((image[0] == 0xA5 && image[1] == 0x5A) || (image[0] == 0x96 && image[1] == 0x69)))
+    return -1;
+  size_t data_size = (image[2] << 8) | image[3];
+  if (data_size + 0x34 > len)
+    return -1;
+  if (sum_bytes(&image[2], 0x2E) != ((image[data_size + 0x30] << 8) | image[data_size + 0x31]))
+    return -1;
+  if (sum_bytes(&image[0x30], data_size) != ((image[data_size + 0x32] << 8) | image[data_size + 0x33]))
+    return -1;
+  return (int)data_size;
+}
+
+/* Makes the EEPROM match a target image, writing only the bytes that differ, in the same
+*  order attempt_patch() uses (see plan_image_changes()).
+*/
+static int flash_image(ms2109_device& dev, const uint8_t* target, size_t target_size) {
+  if (!identify_eeprom(dev)) {
+    // blank or corrupt EEPROM, all we can do is trust the image
+    if (target_size != 0x800 && target_size != 0x1000)
+      return -3;
+    dev.max_eeprom_address = (uint16_t)target_size;
+    dev_printf(dev, "Assuming a %u byte EEPROM to match the image\n", dev.max_eeprom_address);
+  }
+  if (target_size != dev.max_eeprom_address) {
+    dev_printf(dev, "Image is for a %u byte EEPROM but the device has %u bytes\n", (unsigned)target_size, dev.max_eeprom_address);
+    return -4;
+  }
+  if (check_image(target, target_size) < 0 || target[0] != (dev.max_eeprom_address > 0x800 ? 0x96 : 0xA5)) {
+    dev_printf(dev, "Image doesn't have a valid signature and checksums for this EEPROM, refusing to flash it\n");
+    return -5;
+  }
+
+  std::vector<uint8_t> current;
+  if (!read_eeprom_snapshot(dev, current))
+    return -6;
+
+  size_t changed = 0;
+  for (size_t a = 0; a < target_size; a++)
+    changed += current[a] != target[a];
+  dev_printf(dev, "%u of %u bytes differ\n", (unsigned)changed, (unsigned)target_size);
+  if (changed == 0)
+    return 0;
+
+  int ret = write_image_changes(dev, current.data(), target, target_size, check_image(current.data(), current.size()), "flash");
+  if (ret < 0)
+    return ret;
+
+  dev_printf(dev, "\n\nFlashing is complete!\n");
+  return 0;
+}
+
+/* apparently XDATA@F002 should be cleared whilst accessing EEPROM.
+*  Maybe this is a GPIO connected to the EEPROM's WP pin
+*  but for my devices it seems to make no difference - possibly
+*  the cheap makers didn't bother connecting it and just grounded the pin...
+*  Returns true if f002 holds a value that must be restored afterwards.
+*/
+static BOOLEAN begin_eeprom_access(ms2109_device& dev, uint8_t& f002) {
+  if (read_xdata_byte(dev, 0xF002, f002) && f002 != 0)
+    return write_xdata_byte(dev, 0xF002, 0);
+  return false;
+}
+
+/* Patched devices seen before are recognised by their instance ID and EEPROM version, which
+*  confirming takes one batch of three EEPROM reads instead of the dozen or so round trips that
+*  identifying the chip and its audio descriptor need.
+*  Instance IDs go by USB port and every stick with the same firmware has the same version, so
+*  the code size has to match as well and the hook site still has to hold the patch's LCALL.
+*  Returns true if the device is the patched one in the cache.
+*/
+static BOOLEAN use_cached_fingerprint(ms2109_device& dev, const device_fingerprint* cached) {
+  if (cached == NULL)
+    return false;
+  const uint16_t addresses[3] = { 0, 12, (uint16_t)(0x30 + hook_sites[0].offset) };
+  feature_report reps[3] = {};
+  for (int i = 0; i < 3; i++) {
+    reps[i].cmd = 0xE5;
+    reps[i].address_hi = (uint8_t)(addresses[i] >> 8);
+    reps[i].address_lo = (uint8_t)addresses[i];
+    reps[i].data[4] = cached->eeprom_size >> 12;
+  }
+  BOOLEAN ok = dev.transport->transact(reps, 3) == 3;
+  uint32_t version = ok ? (reps[1].data[0] << 24) | (reps[1].data[1] << 16) | (reps[1].data[2] << 8) | reps[1].data[3] : 0;
+  if (!ok || version != cached->version || ((reps[0].data[2] << 8) | reps[0].data[3]) != cached->code_size || reps[2].data[0] != 0x12) {
+    dev_printf(dev, "Device has changed since it was last seen, identifying it again\n");
+    return false;
+  }
+  dev.max_eeprom_address = cached->eeprom_size;
+  dev_printf(dev, "Known device: version %08X, %u byte EEPROM, code size %04X, patched\n", version, cached->eeprom_size,
+    cached->code_size);
+  dev.eeprom_identified = true;
+  dev.fingerprint = *cached;
+  dev.fingerprint_valid = true;
+  return true;
+}
+
+/* Records an already patched device, so it can be skipped straight away next time. Only the
+*  EEPROM gets to say it's patched: the hook site has to hold an LCALL into the code.
+*  Returns false if it doesn't (or couldn't be read), and then nothing is recorded.
+*/
+static BOOLEAN fingerprint_patched_device(ms2109_device& dev) {
+  uint16_t code_size;
+  uint32_t version;
+  uint8_t call[3];
+  if (!identify_eeprom(dev) || !read_eeprom_word(dev, 2, code_size) || !read_eeprom_dword(dev, 12, version)
+    || !read_eeprom_range(dev, 0x30 + hook_sites[0].offset, call, 3))
+    return false;
+  uint16_t target = (call[1] << 8) | call[2];
+  if (call[0] != 0x12 || target < 0xCC00 || target >= 0xCC00 + code_size)
+    return false;
+  dev.fingerprint.version = version;
+  dev.fingerprint.eeprom_size = dev.max_eeprom_address;
+  dev.fingerprint.code_size = code_size;
+  dev.fingerprint_valid = true;
+  return true;
+}
+
+// finishes an interrupted patch or flash with F002 cleared, see resume_journal()
+static int resume_device(ms2109_device& dev) {
+  std::string what;
+  uint8_t f002;
+  BOOLEAN restore_f002 = begin_eeprom_access(dev, f002);
+  int ret = resume_journal(dev, what);
+  if (restore_f002) write_xdata_byte(dev, 0xF002, f002);
+  if (ret == 0 && what == "patch")
+    fingerprint_patched_device(dev);
+  else
+    dev.fingerprint_stale = true;
+  return ret;
+}
+
+static int patch_device(ms2109_device& dev, const device_fingerprint* cached) {
+  int ret;
+  // the cache can't know about a patch that never finished
+  BOOLEAN interrupted = journal_pending(dev);
+  BOOLEAN known = !interrupted && use_cached_fingerprint(dev, cached);
+  if (known) {
+    dev_printf(dev, "Device is already patched, nothing to do\n");
+    ret = -300;
+  }
+  else if (!identify_ms2109(dev)) {
+    dev_printf(dev, " could not confirm MS2109 chip ID!\n");
+    ret = -200;
+  }
+  else if (interrupted)
+    ret = resume_device(dev);
+  else if (!has_mono_descriptor(dev)) {
+    dev_printf(dev, " could not find mono USB audio format descriptor in XDATA; is device already patched?\n");
+    fingerprint_patched_device(dev);
+    ret = -300;
+  }
+  else {
+    dev_printf(dev, "Attempting to patch device\n");
+
+    uint8_t f002;
+    BOOLEAN restore_f002 = begin_eeprom_access(dev, f002);
+    ret = attempt_patch(dev);
+    if (restore_f002) write_xdata_byte(dev, 0xF002, f002);
+  }
+  return ret;
+}
+
+static int flash_device(ms2109_device& dev, const std::vector<uint8_t>& target) {
+  if (!identify_ms2109(dev)) {
+    dev_printf(dev, " could not confirm MS2109 chip ID!\n");
+    return -200;
+  }
+  if (journal_pending(dev)) {
+    int ret = resume_device(dev);
+    if (ret != 0)
+      return ret;
+  }
+  dev_printf(dev, "Attempting to flash device\n");
+
+  uint8_t f002;
+  BOOLEAN restore_f002 = begin_eeprom_access(dev, f002);
+  int ret = flash_image(dev, target.data(), target.size());
+  if (restore_f002) write_xdata_byte(dev, 0xF002, f002);
+  return ret;
+}
+
+/* After patching, the old driver has to go: windows is too stupid to realize the device descriptor
+*  has changed and keeps using the cached one (see ms2109_device::instance). Removing the USB
+*  device together with everything below it makes it start from scratch when it's replugged.
+*  On Linux there's no such cache, but deauthorizing the device unbinds its drivers in the same
+*  way, so nothing keeps using the unpatched descriptors until it's replugged.
+*/
+#ifdef _WIN32
+// the subtree under devinst, children before their parents
+static void collect_subtree(DEVINST devinst, std::vector<std::basic_string<TCHAR>>& ids) {
+  DEVINST child;
+  if (CM_Get_Child(&child, devinst, 0) == CR_SUCCESS) {
+    do collect_subtree(child, ids);
+    while (CM_Get_Sibling(&child, child, 0) == CR_SUCCESS);
+  }
+  TCHAR id[MAX_DEVICE_ID_LEN];
+  if (CM_Get_Device_ID(devinst, id, MAX_DEVICE_ID_LEN, 0) == CR_SUCCESS)
+    ids.push_back(id);
+}
+
+// returns 0 or the CONFIGRET of whatever failed, with a description in error
+static int reset_device(const std::string& instance, std::string& error) {
+  std::basic_string<TCHAR> id(instance.begin(), instance.end());
+  DEVINST devinst;
+  CONFIGRET cr = CM_Locate_DevNode(&devinst, (DEVINSTID)id.c_str(), CM_LOCATE_DEVNODE_NORMAL);
+  if (cr != CR_SUCCESS) {
+    error = "device not found";
+    return cr;
+  }
+
+  // while it's all still there; once removed the children can't be walked any more
+  std::vector<std::basic_string<TCHAR>> subtree;
+  collect_subtree(devinst, subtree);
+
+  PNP_VETO_TYPE veto = PNP_VetoTypeUnknown;
+  TCHAR veto_name[MAX_PATH] = {};
+  cr = CM_Query_And_Remove_SubTree(devinst, &veto, veto_name, MAX_PATH, CM_REMOVE_NO_RESTART);
+  if (cr != CR_SUCCESS) {
+    error = veto_name[0] ? "in use by " + narrow(veto_name) : "removal was refused";
+    return cr;
+  }
+  for (const std::basic_string<TCHAR>& node : subtree) {
+    DEVINST removed;
+    if (CM_Locate_DevNode(&removed, (DEVINSTID)node.c_str(), CM_LOCATE_DEVNODE_PHANTOM) == CR_SUCCESS
+      && (cr = CM_Uninstall_DevNode(removed, 0)) != CR_SUCCESS) {
+      error = "couldn't uninstall " + narrow(node.c_str());
+      return cr;
+    }
+  }
+  return 0;
+}
+
+static BOOLEAN is_elevated(void) {
+  HANDLE token;
+  TOKEN_ELEVATION elevation = {};
+  DWORD size;
+  if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &token))
+    return false;
+  BOOLEAN ok = GetTokenInformation(token, TokenElevation, &elevation, sizeof(elevation), &size);
+  CloseHandle(token);
+  return ok && elevation.TokenIsElevated;
+}
+#else
+// returns 0 or the errno of whatever failed, with a description in error
+static int reset_device(const std::string& instance, std::string& error) {
+  // instance is a sysfs name like "1-2" or "3-1.4"
+  if (instance.empty() || instance.find('/') != std::string::npos || instance[0] == '.') {
+    error = "not a USB device name";
+    return EINVAL;
+  }
+  std::string path = "/sys/bus/usb/devices/" + instance + "/authorized";
+  FILE* f = fopen(path.c_str(), "w");
+  int ret = 0;
+  if (f == NULL || fputs("0\n", f) < 0)
+    ret = errno;
+  if (f && fclose(f) != 0 && ret == 0)
+    ret = errno;
+  if (ret)
+    error = path + ": " + strerror(ret);
+  return ret;
+}
+#endif
+
+/* --reset-devices <result file> <instance>...: the elevated side of reset_devices(). Writes
+*  "<result> <instance> <error>" per device to the result file, or stdout for "-".
+*/
+static int reset_worker(const char* result_file, int count, char** instances) {
+  FILE* out = strcmp(result_file, "-") ? fopen(result_file, "w") : stdout;
+  if (out == NULL)
+    return -1;
+  for (int i = 0; i < count; i++) {
+    std::string error;
+    int ret = reset_device(instances[i], error);
+    fprintf(out, "%d %s %s\n", ret, instances[i], error.c_str());
+  }
+  if (out != stdout) fclose(out);
+  return 0;
+}
+
+/* Resets every device at once. Unless we're elevated already, windows needs the removal done
+*  by an elevated process, so this runs itself as one with --reset-devices: a single UAC prompt
+*  for however many devices there are, rather than one pnputil launch each. The per-device
+*  results come back through a temporary file.
+*/
+static void reset_devices(std::vector<ms2109_device*>& devices) {
+  std::map<std::string, std::pair<int, std::string>> results;
+  auto start = std::chrono::steady_clock::now();
+
+#ifdef _WIN32
+  fprintf(stderr, "Removing the old USB drivers of %u device(s) so the new descriptors get picked up.\n"
+    "Please ensure no other applications are currently using them.\n", (unsigned)devices.size());
+  if (is_elevated()) {
+    for (ms2109_device* dev : devices) {
+      std::string error;
+      int ret = reset_device(narrow(dev->instance), error);
+      results[narrow(dev->instance)] = std::make_pair(ret, error);
+    }
+  }
+  else {
+    const DWORD WORKER_TIMEOUT_MS = 120000;
+    fprintf(stderr, "You will need to give administrator permission for this to succeed.\n");
+    TCHAR temp_dir[MAX_PATH + 1], result_file[MAX_PATH + 1], exe[MAX_PATH + 1];
+    if (!GetModuleFileName(NULL, exe, MAX_PATH) || !GetTempPath(MAX_PATH, temp_dir)
+      || !GetTempFileName(temp_dir, TEXT("ms2"), 0, result_file)) {
+      fprintf(stderr, "Failed to set up the driver removal\n");
+      return;
+    }
+    std::basic_string<TCHAR> params(TEXT("--reset-devices \""));
+    params += result_file;
+    params += TEXT("\"");
+    for (ms2109_device* dev : devices) {
+      params += TEXT(" \"");
+      params += dev->instance;
+      params += TEXT("\"");
+    }
+
+    SHELLEXECUTEINFO info;
+    memset(&info, 0, sizeof(info));
+    info.cbSize = sizeof(info);
+    info.fMask = SEE_MASK_NOCLOSEPROCESS | SEE_MASK_NOASYNC;
+    info.lpVerb = TEXT("runas");
+    info.lpFile = exe;
+    info.lpParameters = params.c_str();
+    info.nShow = SW_HIDE;
+    // GetTempFileName() created the result file, so it gets deleted below whatever happens to the worker
+    BOOLEAN started = ShellExecuteEx(&info) && info.hProcess;
+    if (!started) {
+      DWORD err = GetLastError();
+      if (err == ERROR_CANCELLED) fprintf(stderr, "Administrator permission was refused\n");
+      else fprintf(stderr, "Failed to start the driver removal (%lu)\n", err);
+    }
+    else {
+      if (WaitForSingleObject(info.hProcess, WORKER_TIMEOUT_MS) != WAIT_OBJECT_0) {
+        // it could still be writing the results, so don't read them until it's gone
+        fprintf(stderr, "Driver removal didn't finish in time, stopping it\n");
+        started = TerminateProcess(info.hProcess, 1) && WaitForSingleObject(info.hProcess, 5000) == WAIT_OBJECT_0;
+      }
+      CloseHandle(info.hProcess);
+    }
+    FILE* f = started ? _tfopen(result_file, TEXT("r")) : NULL;
+    char line[512];
+    while (f && fgets(line, sizeof(line), f)) {
+      char instance[256];
+      int ret, used = 0;
+      if (sscanf(line, "%d %255s %n", &ret, instance, &used) < 2)
+        continue;
+      std::string error(line + used);
+      while (!error.empty() && (error.back() == '\n' || error.back() == '\r')) error.pop_back();
+      results[instance] = std::make_pair(ret, error);
+    }
+    if (f) fclose(f);
+    DeleteFile(result_file);
+  }
+  const char* advice = "you may need to manually uninstall the USB drivers for the MS2109 device";
+#else
+  // only root can deauthorize devices, and replugging does the same job anyway
+  if (geteuid() != 0) {
+    fprintf(stderr, "Not running as root, so the old drivers are still bound; unplug and replug the patched device(s)\n");
+    return;
+  }
+  for (ms2109_device* dev : devices) {
+    std::string error;
+    int ret = reset_device(narrow(dev->instance), error);
+    results[narrow(dev->instance)] = std::make_pair(ret, error);
+  }
+  const char* advice = "unplug and replug it so the new descriptors get used";
+#endif
+
+  unsigned done = 0;
+  for (ms2109_device* dev : devices) {
+    auto it = results.find(narrow(dev->instance));
+    if (it == results.end())
+      dev_printf(*dev, "Old USB driver wasn't removed (no administrator permission?); %s\n", advice);
+    else if (it->second.first != 0)
+      dev_printf(*dev, "Failed to remove the old USB driver (%d, %s); %s\n", it->second.first, it->second.second.c_str(), advice);
+    else {
+      dev_printf(*dev, "Old USB driver has been removed.\n");
+      done++;
+    }
+  }
+  fprintf(stderr, "Reset %u of %u device(s) in %.2f seconds\n", done, (unsigned)devices.size(),
+    std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+}
+
+/* Reads the whole EEPROM twice, once a word at a time the way the patcher used to and once
+*  with the bulk reader, and reports the cost of each per KB.
+*/
+static int benchmark_read(ms2109_device& dev) {
+  if (!identify_eeprom(dev))
+    return -3;
+
+  std::vector<uint8_t> by_word(dev.max_eeprom_address), bulk;
+  unsigned long reports = dev.transport->reports;
+  auto start = std::chrono::steady_clock::now();
+  for (uint16_t a = 0; a < dev.max_eeprom_address; a += 2) {
+    uint16_t w;
+    if (!read_eeprom_word(dev, a, w))
+      return -4;
+    by_word[a] = w >> 8;
+    by_word[a + 1] = (uint8_t)w;
+  }
+  double word_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  unsigned long word_reports = dev.transport->reports - reports;
+
+  reports = dev.transport->reports;
+  start = std::chrono::steady_clock::now();
+  if (!read_eeprom_snapshot(dev, bulk))
+    return -4;
+  double bulk_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  unsigned long bulk_reports = dev.transport->reports - reports;
+
+  if (bulk != by_word) {
+    dev_printf(dev, "Bulk EEPROM read doesn't match word-by-word read!\n");
+    return -5;
+  }
+
+  double kb = dev.max_eeprom_address / 1024.0;
+  dev_printf(dev, "Read %u byte EEPROM:\n", dev.max_eeprom_address);
+  dev_printf(dev, "  per word: %7.1f round trips/KB %8.2f ms/KB\n", word_reports / 2 / kb, word_time * 1000 / kb);
+  dev_printf(dev, "  bulk:     %7.1f round trips/KB %8.2f ms/KB\n", bulk_reports / 2 / kb, bulk_time * 1000 / kb);
+  return 0;
+}
+
+/* Reads the whole EEPROM of every device, first one device after another, then all at once
+*  with a thread per device sending its whole read as one transact() batch, and checks both
+*  give the same data.
+*/
+static int benchmark_async(std::vector<ms2109_device*>& devices) {
+  for (ms2109_device* dev : devices) {
+    if (!identify_eeprom(*dev))
+      return -3;
+  }
+
+  std::vector<std::vector<uint8_t>> sync_data(devices.size());
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < devices.size(); i++) {
+    if (!read_eeprom_snapshot(*devices[i], sync_data[i]))
+      return -4;
+  }
+  double sync_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::vector<std::vector<feature_report>> reps(devices.size());
+  std::vector<size_t> done(devices.size());
+  for (size_t i = 0; i < devices.size(); i++)
+    make_eeprom_reads(*devices[i], 0, devices[i]->max_eeprom_address, reps[i]);
+  start = std::chrono::steady_clock::now();
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < devices.size(); i++)
+    workers.push_back(std::thread([&, i] { done[i] = devices[i]->transport->transact(reps[i].data(), reps[i].size()); }));
+  for (std::thread& t : workers)
+    t.join();
+  double parallel_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  for (size_t i = 0; i < devices.size(); i++) {
+    ms2109_device& dev = *devices[i];
+    if (done[i] != reps[i].size()) {
+      dev_printf(dev, "Failed to read EEPROM @ %04X\n", (unsigned)(done[i] * EEPROM_READ_CHUNK));
+      return -4;
+    }
+    for (size_t a = 0; a < dev.max_eeprom_address; a++) {
+      if (reps[i][a / EEPROM_READ_CHUNK].data[a % EEPROM_READ_CHUNK] != sync_data[i][a]) {
+        dev_printf(dev, "Parallel read doesn't match the one at a time read @ %04X!\n", (unsigned)a);
+        return -5;
+      }
+    }
+  }
+
+  fprintf(stderr, "Read the EEPROMs of %u device(s):\n", (unsigned)devices.size());
+  fprintf(stderr, "  one at a time: %8.3f seconds\n", sync_time);
+  fprintf(stderr, "  all at once:   %8.3f seconds\n", parallel_time);
+  return 0;
+}
+
+/* Runs attempt_patch() on an EEPROM dump instead of a device. The file is mapped and accessed
+*  directly, so a whole directory of dumps can be checked in a blink; the patched image is only
+*  written out (to a different file) if everything succeeded.
+*/
+static int patch_image(const char* filename, const char* out) {
+  mapped_image img;
+  if (!img.open(filename))
+    return -100;
+  if (img.size < 0x800) {
+    fprintf(stderr, "%s is too small to be an EEPROM dump\n", filename);
+    return -100;
+  }
+
+  fprintf(stderr, "MS2109 firmware patcher, patching EEPROM image %s\n", filename);
+  ms2109_device dev;
+  dev.transport = new eeprom_image_transport(img.data, img.size);
+  auto start = std::chrono::steady_clock::now();
+  int ret = attempt_patch(dev);
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  fprintf(stderr, "Image processed in %.3f ms\n", elapsed * 1000);
+  if (ret == 0 && out != NULL) {
+    if (!save_file(out, img.data, img.size))
+      return -1;
+    fprintf(stderr, "Patched image written to %s\n", out);
+  }
+  return ret;
+}
+
+/* Patches two simulated devices loaded with the same image, one with a verified write per byte
+*  and one with the batched writer, and checks that both end up with identical EEPROMs.
+*/
+static int benchmark_patch(const std::vector<uint8_t>& image, unsigned latency, unsigned write_cycle) {
+  ms2109_device legacy, batched;
+  ms2109_simulator* sims[2] = { new ms2109_simulator(image, latency, write_cycle), new ms2109_simulator(image, latency, write_cycle) };
+  legacy.transport = sims[0];
+  legacy.verify_each_write = true;
+  batched.transport = sims[1];
+  double elapsed[2];
+  int ret = 0;
+
+  for (int pass = 0; pass < 2 && ret == 0; pass++) {
+    auto start = std::chrono::steady_clock::now();
+    ret = attempt_patch(pass ? batched : legacy);
+    elapsed[pass] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+  if (ret != 0)
+    return ret;
+
+  if (sims[0]->eeprom != sims[1]->eeprom) {
+    fprintf(stderr, "Batched writes produced a different EEPROM than per-byte writes!\n");
+    return -15;
+  }
+  fprintf(stderr, "\nPatch results are identical\n");
+  fprintf(stderr, "  per-byte writes: %5lu feature reports %8.3f seconds\n", sims[0]->reports, elapsed[0]);
+  fprintf(stderr, "  batched writes:  %5lu feature reports %8.3f seconds\n", sims[1]->reports, elapsed[1]);
+  return 0;
+}
+
+/* The access layer benchmarks run by --bench-suite. setup gets a fresh simulated device to where
+*  the benchmark starts from and isn't timed, run is what gets measured.
+*/
+struct suite_benchmark {
+  const char* name;
+  BOOLEAN (*setup)(ms2109_device& dev);
+  BOOLEAN (*run)(ms2109_device& dev);
+};
+
+static BOOLEAN suite_nothing(ms2109_device&) {
+  return true;
+}
+
+static BOOLEAN suite_identify(ms2109_device& dev) {
+  return identify_ms2109(dev) && identify_eeprom(dev);
+}
+
+static BOOLEAN suite_read(ms2109_device& dev) {
+  std::vector<uint8_t> image;
+  return read_eeprom_snapshot(dev, image);
+}
+
+static BOOLEAN suite_patch(ms2109_device& dev) {
+  return attempt_patch(dev) == 0;
+}
+
+// reads the header and code the checksums cover and checks them
+static BOOLEAN suite_verify(ms2109_device& dev) {
+  uint16_t data_size;
+  if (!read_eeprom_word(dev, 2, data_size) || data_size + 0x34u > dev.max_eeprom_address)
+    return false;
+  std::vector<uint8_t> image(data_size + 0x34);
+  return read_eeprom_range(dev, 0, image.data(), image.size()) && check_image(image.data(), image.size()) == data_size;
+}
+
+// a second of --monitor on a 60Hz source, with every poll reading everything it publishes
+static BOOLEAN suite_telemetry(ms2109_device& dev) {
+  static const uint16_t addresses[] = {
+    ADDR_HDMI_CONNECTION_STATUS, ADDR_INPUT_PIXELCLK, ADDR_INPUT_PIXELCLK + 1,
+    ADDR_INPUT_WIDTH, ADDR_INPUT_WIDTH + 1, ADDR_INPUT_HEIGHT, ADDR_INPUT_HEIGHT + 1, ADDR_INPUT_FPS
+  };
+  uint8_t vals[8];
+  for (int i = 0; i < 60; i++) {
+    if (!read_xdata_bytes(dev, addresses, vals, 8))
+      return false;
+  }
+  return true;
+}
+
+static const suite_benchmark suite_benchmarks[] = {
+  { "identify",        suite_nothing,  suite_identify },
+  { "eeprom_read",     suite_identify, suite_read },
+  { "patch",           suite_identify, suite_patch },
+  { "checksum_verify", suite_identify, suite_verify },
+  { "telemetry_60",    suite_identify, suite_telemetry },
+};
+
+/* Runs every suite_benchmark on both EEPROM sizes, each run on a fresh simulated device, and
+*  prints one JSON object per benchmark and size on stdout so the numbers can be compared between
+*  builds. Report counts don't depend on the machine, so any change in them is a real change in
+*  how much the patcher talks to the device; times are the median and best of the runs.
+*/
+static int benchmark_suite(unsigned latency, unsigned write_cycle, unsigned runs) {
+  static const uint16_t sizes[] = { 0x800, 0x1000 };
+  int ret = 0;
+  if (runs == 0) runs = 1;
+
+  for (uint16_t size : sizes) {
+    std::vector<uint8_t> image = make_sim_image(size);
+    for (const suite_benchmark& b : suite_benchmarks) {
+      std::vector<double> times;
+      unsigned long reports = 0;
+      BOOLEAN ok = true;
+      for (unsigned r = 0; r < runs && ok; r++) {
+        ms2109_device dev;
+        ms2109_simulator* sim = new ms2109_simulator(image, latency, write_cycle);
+        dev.transport = sim;
+        dev.quiet = true;
+        if (!b.setup(dev)) {
+          ok = false;
+          break;
+        }
+        unsigned long before = sim->reports;
+        auto start = std::chrono::steady_clock::now();
+        ok = b.run(dev);
+        times.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        reports = sim->reports - before;
+        // every benchmark has to go down the right path for this EEPROM size
+        if (dev.eeprom_identified && dev.max_eeprom_address != size)
+          ok = false;
+      }
+      if (!ok) {
+        fprintf(stderr, "%s failed on the %u byte EEPROM\n", b.name, size);
+        ret = -1;
+        continue;
+      }
+      std::sort(times.begin(), times.end());
+      printf("{\"benchmark\":\"%s\",\"eeprom_size\":%u,\"latency_us\":%u,\"runs\":%u,\"reports\":%lu,\"median_ms\":%.3f,\"min_ms\":%.3f}\n",
+        b.name, size, latency, runs, reports, times[times.size() / 2] * 1000, times[0] * 1000);
+      fflush(stdout);
+    }
+  }
+  return ret;
+}
+
+/* Pulls the plug on a simulated patch at every single EEPROM write, once losing the write in
+*  flight and once leaving a garbage byte behind, then "replugs" the device and lets the journal
+*  finish the job. Every run has to end up with exactly the EEPROM an uninterrupted patch gives.
+*/
+static int test_journal(const std::vector<uint8_t>& image, const std::string& journal_file) {
+  std::vector<uint8_t> golden;
+  unsigned total;
+  {
+    ms2109_device dev;
+    ms2109_simulator* sim = new ms2109_simulator(image, 0);
+    dev.transport = sim;
+    dev.quiet = true;
+    if (patch_device(dev, NULL) != 0) {
+      fprintf(stderr, "Uninterrupted patch failed\n");
+      return -1;
+    }
+    golden = sim->eeprom;
+    total = sim->eeprom_writes;
+  }
+
+  unsigned runs = 0, failures = 0;
+  for (int tear = 0; tear < 2; tear++) {
+    for (unsigned n = 1; n <= total; n++, runs++) {
+      remove(journal_file.c_str());
+      std::vector<uint8_t> interrupted;
+      int ret[2];
+      {
+        ms2109_device dev;
+        ms2109_simulator* sim = new ms2109_simulator(image, 0);
+        sim->fail_after_writes = n;
+        sim->tear_failed_write = tear != 0;
+        dev.transport = sim;
+        dev.journal_file = journal_file;
+        dev.quiet = true;
+        ret[0] = patch_device(dev, NULL);
+        interrupted = sim->eeprom;
+      }
+      ms2109_device dev;
+      ms2109_simulator* sim = new ms2109_simulator(interrupted, 0);
+      dev.transport = sim;
+      dev.journal_file = journal_file;
+      dev.quiet = true;
+      ret[1] = patch_device(dev, NULL);
+
+      const char* problem = NULL;
+      if (ret[0] == 0) problem = "the interrupted patch didn't fail";
+      else if (ret[1] != 0) problem = "resuming failed";
+      else if (sim->eeprom != golden) problem = "resuming gave the wrong EEPROM";
+      else if (journal_pending(dev)) problem = "the journal was left behind";
+      if (problem) {
+        fprintf(stderr, "  %s write %u of %u: %s (%d, %d)\n", tear ? "torn" : "lost", n, total, problem, ret[0], ret[1]);
+        failures++;
+      }
+    }
+  }
+  remove(journal_file.c_str());
+  fprintf(stderr, "%u interrupted patches (%u writes each lost and torn), %u recovered\n", runs, total, runs - failures);
+  return failures ? -17 : 0;
+}
+
+/* Runs the same job on every device at once, one thread each, so the total time is that of
+*  the slowest device rather than the sum of all of them.
+*/
+template <class F>
+static void run_on_all(std::vector<ms2109_device*>& devices, F job) {
+  auto run = [&job](ms2109_device* dev) {
+    auto start = std::chrono::steady_clock::now();
+    if (!dev->label.empty()) trace_thread_name(dev->label);
+    dev->result = job(*dev);
+    dev->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  };
+
+  if (devices.size() == 1) {
+    run(devices[0]);
+    return;
+  }
+  std::vector<std::thread> workers;
+  for (ms2109_device* dev : devices)
+    workers.push_back(std::thread(run, dev));
+  for (std::thread& t : workers)
+    t.join();
+}
+
+/* Picture settings. The firmware keeps each one as a signed 16-bit value (BRIGHTNESS etc.) and
+*  the video hardware has an 8-bit register for it (ADDR_BRIGHTNESS etc.) holding the low byte.
+*/
+enum { COLOR_BRIGHTNESS, COLOR_CONTRAST, COLOR_HUE, COLOR_SATURATION, COLOR_COUNT };
+
+static const struct {
+  const char* name;
+  uint16_t setting, reg;
+} color_controls[COLOR_COUNT] = {
+  { "brightness", BRIGHTNESS, ADDR_BRIGHTNESS },
+  { "contrast",   CONTRAST,   ADDR_CONTRAST },
+  { "hue",        HUE,        ADDR_HUE },
+  { "saturation", SATURATION, ADDR_SATURATION },
+};
+
+static int find_color_control(const char* name) {
+  for (int i = 0; i < COLOR_COUNT; i++) {
+    if (!strcmp(name, color_controls[i].name))
+      return i;
+  }
+  return -1;
+}
+
+struct color_settings {
+  int16_t value[COLOR_COUNT];
+  BOOLEAN set[COLOR_COUNT]; // settings that aren't set are left alone
+};
+
+/* Changes any number of picture settings with one batch of reads and one batch of writes.
+*  The chip ID and all current values are read together, and only bytes that actually change
+*  get written. Each hardware register is written in a single report after the firmware's
+*  copy, so the picture switches from the old value to the new one without passing through a
+*  half-written one. The firmware's copy only changes atomically when its high byte stays the
+*  same; otherwise it's two reports and briefly holds a mix of old and new bytes, so the bytes
+*  are written in whichever order makes that mix closer to the new value.
+*/
+static int apply_color_settings(ms2109_device& dev, const color_settings& want) {
+  uint16_t addresses[3 + COLOR_COUNT * 3] = { 0xF800, 0xF801, 0xF802 };
+  uint8_t current[3 + COLOR_COUNT * 3];
+  for (int i = 0; i < COLOR_COUNT; i++) {
+    addresses[3 + i * 3] = color_controls[i].setting;
+    addresses[3 + i * 3 + 1] = color_controls[i].setting + 1;
+    addresses[3 + i * 3 + 2] = color_controls[i].reg;
+  }
+  if (!read_xdata_bytes(dev, addresses, current, 3 + COLOR_COUNT * 3))
+    return -5;
+  if (current[0] != 0xA7 || current[1] != 0x10 || current[2] != 0x9A) {
+    dev_printf(dev, "Failed to identify MS2109 chip (%02X:%02X:%02X)\n", current[0], current[1], current[2]);
+    return -200;
+  }
+
+  uint16_t write_addresses[COLOR_COUNT * 3], reg_addresses[COLOR_COUNT];
+  uint8_t write_vals[COLOR_COUNT * 3], reg_vals[COLOR_COUNT];
+  size_t writes = 0, regs = 0;
+  for (int i = 0; i < COLOR_COUNT; i++) {
+    const uint8_t* cur = &current[3 + i * 3];
+    int16_t old = (int16_t)((cur[0] << 8) | cur[1]);
+    if (!want.set[i])
+      continue;
+    int16_t v = want.value[i];
+    uint8_t bytes[2] = { (uint8_t)(v >> 8), (uint8_t)v };
+    int16_t high_first = (int16_t)((bytes[0] << 8) | cur[1]), low_first = (int16_t)((cur[0] << 8) | bytes[1]);
+    int first = abs(low_first - v) < abs(high_first - v) ? 1 : 0;
+    for (int j = first; j < first + 2; j++) {
+      if (cur[j & 1] != bytes[j & 1]) {
+        write_addresses[writes] = color_controls[i].setting + (j & 1);
+        write_vals[writes++] = bytes[j & 1];
+      }
+    }
+    if (cur[2] != bytes[1]) {
+      reg_addresses[regs] = color_controls[i].reg;
+      reg_vals[regs++] = bytes[1];
+    }
+    if (old != v || cur[2] != bytes[1])
+      dev_printf(dev, "%s %d -> %d\n", color_controls[i].name, old, v);
+  }
+  // hardware registers go last, after every firmware value is complete
+  for (size_t i = 0; i < regs; i++) {
+    write_addresses[writes] = reg_addresses[i];
+    write_vals[writes++] = reg_vals[i];
+  }
+  if (writes == 0) {
+    dev_printf(dev, "Picture settings are already as requested\n");
+    return 0;
+  }
+  return write_xdata_bytes(dev, write_addresses, write_vals, writes) ? 0 : -10;
+}
+
+/* Input signal telemetry, as published by --monitor. The 16-bit values are big-endian in XDATA
+*  like everything else; the pixel clock is passed on as the raw register value.
+*/
+struct signal_state {
+  uint16_t width, height, pixel_clock;
+  uint8_t fps, hdmi_status;
+
+  bool operator!=(const signal_state& o) const {
+    return width != o.width || height != o.height || pixel_clock != o.pixel_clock || fps != o.fps || hdmi_status != o.hdmi_status;
+  }
+};
+
+#define MONITOR_SHM_NAME "ms2109_monitor"
+#define MONITOR_MAGIC    0x4D534D31 // "MSM1"
+#define MONITOR_SLOTS    32
+
+/* The shared memory --monitor publishes to, one slot per device. Each slot is a seqlock: the
+*  monitor makes seq odd, updates the slot and makes seq even again; a reader copies the slot
+*  and tries again if seq was odd or changed in the meantime. Readers never hold up the monitor
+*  and don't need anything but read access.
+*/
+struct monitor_slot {
+  std::atomic<uint32_t> seq;
+  char instance[128];
+  signal_state signal;
+  uint8_t online;      // 0 if the device stopped answering
+  uint64_t updated_us; // when it was last polled, steady clock
+  uint32_t polls;
+  uint32_t changes;
+};
+
+struct monitor_shm {
+  uint32_t magic;
+  uint32_t slot_count;
+  monitor_slot slots[MONITOR_SLOTS];
+};
+
+// seqlock writer; only ever one per slot
+static void publish_slot(monitor_slot& slot, const signal_state& signal, BOOLEAN online, uint32_t polls, uint32_t changes) {
+  uint32_t seq = slot.seq.load(std::memory_order_relaxed);
+  slot.seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.signal = signal;
+  slot.online = online;
+  slot.updated_us = std::chrono::duration_cast<std::chrono::microseconds>(trace_clock::now().time_since_epoch()).count();
+  slot.polls = polls;
+  slot.changes = changes;
+  slot.seq.store(seq + 2, std::memory_order_release);
+}
+
+// seqlock reader, copies a consistent snapshot of a slot
+static void read_slot(const monitor_slot& slot, monitor_slot& copy) {
+  for (;;) {
+    uint32_t seq = slot.seq.load(std::memory_order_acquire);
+    if (seq & 1) {
+      std::this_thread::yield();
+      continue;
+    }
+    memcpy(copy.instance, slot.instance, sizeof(copy.instance));
+    copy.signal = slot.signal;
+    copy.online = slot.online;
+    copy.updated_us = slot.updated_us;
+    copy.polls = slot.polls;
+    copy.changes = slot.changes;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.seq.load(std::memory_order_relaxed) == seq)
+      return;
+  }
+}
+
+// there can only be one monitor publishing, creating the shared memory fails if it already exists
+static monitor_shm* open_monitor_shm(BOOLEAN create) {
+  void* mem;
+#ifdef _WIN32
+  HANDLE mapping = create ?
+    CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(monitor_shm), "Local\\" MONITOR_SHM_NAME) :
+    OpenFileMappingA(FILE_MAP_READ, FALSE, "Local\\" MONITOR_SHM_NAME);
+  if (mapping == NULL)
+    return NULL;
+  if (create && GetLastError() == ERROR_ALREADY_EXISTS) {
+    fprintf(stderr, "Another --monitor is already running\n");
+    CloseHandle(mapping);
+    return NULL;
+  }
+  // the mapping lives as long as any view of it does
+  mem = MapViewOfFile(mapping, create ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, sizeof(monitor_shm));
+  CloseHandle(mapping);
+  if (mem == NULL)
+    return NULL;
+#else
+  int fd = shm_open("/" MONITOR_SHM_NAME, create ? O_RDWR | O_CREAT | O_EXCL : O_RDONLY, 0644);
+  if (fd < 0) {
+    if (create && errno == EEXIST)
+      fprintf(stderr, "Another --monitor is already running (if not, delete /dev/shm/" MONITOR_SHM_NAME " left behind by one that crashed)\n");
+    return NULL;
+  }
+  if (create && ftruncate(fd, sizeof(monitor_shm)) != 0) {
+    close(fd);
+    shm_unlink("/" MONITOR_SHM_NAME);
+    return NULL;
+  }
+  mem = mmap(NULL, sizeof(monitor_shm), create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED)
+    return NULL;
+#endif
+  return (monitor_shm*)mem;
+}
+
+static void close_monitor_shm(monitor_shm* shm, BOOLEAN remove) {
+#ifdef _WIN32
+  UnmapViewOfFile(shm);
+#else
+  munmap(shm, sizeof(monitor_shm));
+  if (remove) shm_unlink("/" MONITOR_SHM_NAME);
+#endif
+}
+
+static std::atomic<bool> monitor_stop(false);
+
+static void stop_monitor(int) {
+  monitor_stop = true;
+}
+
+/* Polls a device's input signal registers until told to stop.
+*  Every poll reads just the HDMI connection status and the pixel clock, which changes with
+*  practically any mode change; the rest only gets read when those change, or every few polls
+*  in case the mode changed at the same pixel clock. The device is polled once a frame, so a
+*  change shows up within a frame. With a max_interval_ms longer than that, the interval backs
+*  off towards it once things have been stable for a while, and snaps back to once a frame on
+*  the next change; a change while backed off can then take up to max_interval_ms to show.
+*/
+static int monitor_device(ms2109_device& dev, monitor_slot& slot, unsigned max_interval_ms) {
+  static const uint16_t probe_addresses[] = { ADDR_HDMI_CONNECTION_STATUS, ADDR_INPUT_PIXELCLK, ADDR_INPUT_PIXELCLK + 1 };
+  static const uint16_t full_addresses[] = {
+    ADDR_INPUT_WIDTH, ADDR_INPUT_WIDTH + 1, ADDR_INPUT_HEIGHT, ADDR_INPUT_HEIGHT + 1, ADDR_INPUT_FPS
+  };
+  const unsigned FULL_READ_EVERY = 16;
+  const unsigned STABLE_POLLS = 8; // before backing off
+
+  if (!identify_ms2109(dev))
+    return -200;
+
+  signal_state signal = {};
+  uint32_t polls = 0, changes = 0;
+  unsigned stable = 0, since_full = FULL_READ_EVERY;
+  BOOLEAN online = false;
+  auto next = trace_clock::now();
+  std::chrono::microseconds interval(16667);
+
+  while (!monitor_stop) {
+    uint8_t probe[3], full[5];
+    signal_state now = signal;
+    BOOLEAN ok = read_xdata_bytes(dev, probe_addresses, probe, 3);
+    if (ok) {
+      now.hdmi_status = probe[0];
+      now.pixel_clock = (probe[1] << 8) | probe[2];
+      if (now != signal || !online || ++since_full >= FULL_READ_EVERY) {
+        if ((ok = read_xdata_bytes(dev, full_addresses, full, 5))) {
+          now.width = (full[0] << 8) | full[1];
+          now.height = (full[2] << 8) | full[3];
+          now.fps = full[4];
+          since_full = 0;
+        }
+      }
+    }
+    polls++;
+
+    if (ok && (now != signal || !online)) {
+      if (online) changes++;
+      signal = now;
+      stable = 0;
+      dev_printf(dev, "HDMI %s, %ux%u @ %uHz, pixel clock %04X\n", signal.hdmi_status ? "connected" : "disconnected",
+        signal.width, signal.height, signal.fps, signal.pixel_clock);
+    }
+    if (ok != online && polls > 1)
+      dev_printf(dev, ok ? "Device is answering again\n" : "Device stopped answering, will keep trying\n");
+    online = ok;
+    publish_slot(slot, signal, online, polls, changes);
+
+    // once a frame at whatever rate the source runs at, or 60Hz if there's nothing sensible
+    std::chrono::microseconds frame(1000000 / (signal.fps >= 20 && signal.fps <= 240 ? signal.fps : 60));
+    std::chrono::microseconds max_interval = std::max(frame, std::chrono::microseconds(max_interval_ms * 1000));
+    if (!online)
+      interval = max_interval;
+    else if (stable++ < STABLE_POLLS)
+      interval = frame;
+    else
+      interval = std::min(max_interval, interval * 3 / 2);
+
+    next += interval;
+    auto t = trace_clock::now();
+    if (next < t) next = t;
+    // polling in short naps so stopping doesn't have to wait out a long interval
+    while (!monitor_stop && t < next) {
+      std::this_thread::sleep_for(std::min<trace_clock::duration>(next - t, std::chrono::milliseconds(100)));
+      t = trace_clock::now();
+    }
+  }
+  return 0;
+}
+
+// prints what a running --monitor is publishing
+static int print_monitor(void) {
+  monitor_shm* shm = open_monitor_shm(false);
+  if (shm == NULL || shm->magic != MONITOR_MAGIC) {
+    fprintf(stderr, "No monitor is running\n");
+    if (shm) close_monitor_shm(shm, false);
+    return -1;
+  }
+  uint64_t now = std::chrono::duration_cast<std::chrono::microseconds>(trace_clock::now().time_since_epoch()).count();
+  for (uint32_t i = 0; i < shm->slot_count && i < MONITOR_SLOTS; i++) {
+    monitor_slot s;
+    read_slot(shm->slots[i], s);
+    s.instance[sizeof(s.instance) - 1] = 0;
+    printf("%s: %s, HDMI %s, %ux%u @ %uHz, pixel clock %04X (%u polls, %u changes, last %.1fs ago)\n", s.instance,
+      s.online ? "online" : "offline", s.signal.hdmi_status ? "connected" : "disconnected", s.signal.width, s.signal.height,
+      s.signal.fps, s.signal.pixel_clock, s.polls, s.changes, (now - s.updated_us) / 1e6);
+  }
+  close_monitor_shm(shm, false);
+  return 0;
+}
+
+/* --provision: every MS2109 that gets plugged in goes through identify -> backup -> patch ->
+*  verify. Each device gets its own worker thread for that, so a device spending half a second
+*  having its EEPROM written doesn't hold up any of the others, whatever stage they're at.
+*/
+enum { STAGE_IDENTIFY, STAGE_BACKUP, STAGE_PATCH, STAGE_VERIFY, STAGE_COUNT };
+static const char* const stage_names[STAGE_COUNT] = { "identify", "backup", "patch", "verify" };
+
+struct provision_job {
+  ms2109_device* dev;
+  std::vector<uint8_t> backup;
+  BOOLEAN resume = false; // finishing a patch that was interrupted, see resume_journal()
+  int failed_stage = -1;
+  double stage_seconds[STAGE_COUNT] = {};
+};
+
+static std::atomic<bool> provision_stop(false);
+
+static void stop_provisioning(int) {
+  provision_stop = true;
+}
+
+// gives a simulated device an instance ID, so the cache and journal have something to go on
+static void set_sim_instance(ms2109_device& dev, size_t index) {
+  std::string name = "SIM\\" + std::to_string(index);
+  dev.instance = (TCHAR*)calloc(name.size() + 1, sizeof(TCHAR));
+  if (dev.instance) std::copy(name.begin(), name.end(), dev.instance);
+}
+
+// FNV-1a, to tell backups of different firmwares apart
+static uint32_t hash_bytes(const uint8_t* p, size_t len) {
+  uint32_t h = 0x811C9DC5;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ p[i]) * 0x01000193;
+  return h;
+}
+
+// the stages return 0 to go on to the next one, 1 if there's nothing left to do, <0 on failure
+static int provision_identify(provision_job& job) {
+  ms2109_device& dev = *job.dev;
+  if (!identify_ms2109(dev)) {
+    dev_printf(dev, " could not confirm MS2109 chip ID!\n");
+    return -200;
+  }
+  // an interrupted patch leaves the EEPROM in no state to identify, the journal knows its size
+  job.resume = journal_pending(dev);
+  if (job.resume)
+    return 0;
+  if (!has_mono_descriptor(dev)) {
+    if (!fingerprint_patched_device(dev)) {
+      dev_printf(dev, "Audio format descriptor isn't the mono one but the EEPROM isn't patched either, leaving it alone\n");
+      return -201;
+    }
+    dev_printf(dev, "Device is already patched, nothing to do\n");
+    return 1;
+  }
+  return identify_eeprom(dev) ? 0 : -3;
+}
+
+/* Backups are named after the device and a hash of their contents, so sticks that turn up on
+*  the same port one after another don't overwrite each other's, and identical ones share a file.
+*/
+static int provision_backup(provision_job& job, const std::string& dir) {
+  ms2109_device& dev = *job.dev;
+  if (job.resume) {
+    dev_printf(dev, "Finishing an interrupted patch, the backup was made before it started\n");
+    return 0;
+  }
+  if (!read_eeprom_snapshot(dev, job.backup))
+    return -6;
+
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), "_%08X.backup", hash_bytes(job.backup.data(), job.backup.size()));
+  std::string file = device_file_name(dir.c_str(), dev.instance ? narrow(dev.instance) : dev.label, suffix);
+  FILE* f = fopen(file.c_str(), "rb");
+  if (f) {
+    fclose(f);
+    dev_printf(dev, "Already backed up to %s\n", file.c_str());
+    return 0;
+  }
+  std::vector<uint8_t> packed = pack_image(job.backup.data(), job.backup.size());
+  if (!save_file(file.c_str(), packed.data(), packed.size()))
+    return -11;
+  dev_printf(dev, "Backed up to %s (%u bytes)\n", file.c_str(), (unsigned)packed.size());
+  return 0;
+}
+
+static int provision_patch(provision_job& job) {
+  ms2109_device& dev = *job.dev;
+  if (job.resume)
+    return resume_device(dev);
+  uint8_t f002;
+  BOOLEAN restore_f002 = begin_eeprom_access(dev, f002);
+  int ret = attempt_patch(dev);
+  if (restore_f002) write_xdata_byte(dev, 0xF002, f002);
+  return ret;
+}
+
+/* Reads the whole EEPROM back. Besides having valid checksums it has to be exactly what patching
+*  the backup gives, which catches anything that got written where it shouldn't have been.
+*/
+static int provision_verify(provision_job& job) {
+  ms2109_device& dev = *job.dev;
+  std::vector<uint8_t> current;
+  if (!read_eeprom_snapshot(dev, current))
+    return -6;
+  if (check_image(current.data(), current.size()) < 0) {
+    dev_printf(dev, "Patched EEPROM doesn't have valid checksums!\n");
+    return -15;
+  }
+  if (!job.backup.empty()) {
+    std::vector<uint8_t> expected(job.backup);
+    ms2109_device model;
+    model.transport = new eeprom_image_transport(expected.data(), expected.size());
+    model.quiet = true;
+    if (attempt_patch(model) != 0 || expected != current) {
+      dev_printf(dev, "EEPROM doesn't match the patched backup!\n");
+      return -15;
+    }
+  }
+  dev_printf(dev, "Verified\n");
+  return 0;
+}
+
+class provision_pipeline {
+public:
+  provision_pipeline(const std::string& dir) : backup_dir(dir) {}
+  ~provision_pipeline() {
+    drain();
+    for (provision_job* job : jobs) delete job;
+  }
+
+  void add(ms2109_device* dev) {
+    provision_job* job = new provision_job;
+    job->dev = dev;
+    std::lock_guard<std::mutex> lock(mutex);
+    jobs.push_back(job);
+    in_flight++;
+    workers.push_back(std::thread(&provision_pipeline::worker, this, job));
+  }
+
+  size_t finished(void) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return jobs.size() - in_flight;
+  }
+
+  BOOLEAN idle(void) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return in_flight == 0;
+  }
+
+  // lets every device that's in the pipeline finish
+  void drain(void) {
+    std::vector<std::thread> running;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      running.swap(workers);
+    }
+    for (std::thread& t : running)
+      t.join();
+  }
+
+  // in the order they arrived, valid after drain()
+  std::vector<provision_job*> jobs;
+
+private:
+  void worker(provision_job* job) {
+    if (!job->dev->label.empty()) trace_thread_name(job->dev->label);
+    int ret = 0;
+    for (int stage = 0; stage < STAGE_COUNT && ret == 0; stage++) {
+      auto start = std::chrono::steady_clock::now();
+      switch (stage) {
+      case STAGE_IDENTIFY: ret = provision_identify(*job); break;
+      case STAGE_BACKUP:   ret = provision_backup(*job, backup_dir); break;
+      case STAGE_PATCH:    ret = provision_patch(*job); break;
+      default:             ret = provision_verify(*job); break;
+      }
+      job->stage_seconds[stage] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      if (ret < 0) job->failed_stage = stage;
+    }
+    job->dev->result = ret < 0 ? ret : ret > 0 ? -300 : 0;
+    for (double t : job->stage_seconds) job->dev->seconds += t;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    in_flight--;
+  }
+
+  std::string backup_dir;
+  std::vector<std::thread> workers;
+  size_t in_flight = 0;
+  std::mutex mutex;
+};
+
+static void print_provision_summary(const std::vector<provision_job*>& jobs, double elapsed) {
+  fprintf(stderr, "\n%-32s %-20s %9s %9s %9s %9s\n", "Device", "Result", "Identify", "Backup", "Patch", "Verify");
+  unsigned patched = 0;
+  for (const provision_job* job : jobs) {
+    char result[32];
+    if (job->dev->result == 0) snprintf(result, sizeof(result), "patched"), patched++;
+    else if (job->dev->result == -300) snprintf(result, sizeof(result), "already patched");
+    else snprintf(result, sizeof(result), "%s failed (%d)", stage_names[job->failed_stage], job->dev->result);
+    fprintf(stderr, "%-32s %-20s", job->dev->label.c_str(), result);
+    for (int s = 0; s < STAGE_COUNT; s++) {
+      if (job->stage_seconds[s] > 0) fprintf(stderr, " %9.3f", job->stage_seconds[s]);
+      else fprintf(stderr, " %9s", "-");
+    }
+    fputc('\n', stderr);
+  }
+  fprintf(stderr, "%u of %u devices patched in %.3f seconds\n", patched, (unsigned)jobs.size(), elapsed);
+}
+
+/* Feeds every MS2109 that's plugged in now or later (or the simulated ones, one every 100ms)
+*  through a provision_pipeline until Ctrl+C, count devices are done or, when simulating, all of
+*  them are. prepare sets each device up before it goes in. The devices end up in done.
+*/
+template <class F>
+static int provision(const std::string& backup_dir, const std::vector<ms2109_simulator*>& sims, unsigned count, F prepare,
+  std::vector<ms2109_device*>& done) {
+  const unsigned SIM_PLUG_INTERVAL_MS = 100;
+  std::vector<std::string> arrived, removed;
+  hotplug_watcher watcher;
+  if (sims.empty()) {
+    if (!watcher.start(arrived)) {
+      fprintf(stderr, "Failed to start watching for devices being plugged in\n");
+      return -1;
+    }
+    fprintf(stderr, "Provisioning every MS2109 that gets plugged in, backups go to %s. Press Ctrl+C to stop\n",
+      backup_dir.empty() ? "the current directory" : backup_dir.c_str());
+  }
+  signal(SIGINT, stop_provisioning);
+  signal(SIGTERM, stop_provisioning);
+
+  provision_pipeline pipeline(backup_dir);
+  std::set<std::string> present; // already in (or through) the pipeline and not unplugged since
+  auto start = std::chrono::steady_clock::now();
+  size_t next_sim = 0;
+  while (!provision_stop && !(count && pipeline.finished() >= count)) {
+    if (sims.empty())
+      watcher.wait(arrived, removed, 100);
+    else if (next_sim < sims.size()) {
+      std::this_thread::sleep_until(start + std::chrono::milliseconds(SIM_PLUG_INTERVAL_MS * next_sim));
+      arrived.push_back("sim" + std::to_string(next_sim++));
+    }
+    else if (pipeline.idle())
+      break;
+    else
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    for (const std::string& path : removed)
+      present.erase(path);
+    for (const std::string& path : arrived) {
+      if (present.count(path))
+        continue;
+      ms2109_device* dev;
+      if (sims.empty())
+        dev = open_device(path, false);
+      else {
+        dev = new ms2109_device;
+        dev->transport = sims[next_sim - 1];
+        set_sim_instance(*dev, next_sim - 1);
+      }
+      if (dev == NULL)
+        continue;
+      present.insert(path);
+      dev->label = dev->instance ? narrow(dev->instance) : path;
+      prepare(*dev);
+      pipeline.add(dev);
+    }
+    arrived.clear();
+    removed.clear();
+  }
+  if (provision_stop)
+    fprintf(stderr, "Stopping, letting the devices that are being worked on finish\n");
+  pipeline.drain();
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  if (!pipeline.jobs.empty())
+    print_provision_summary(pipeline.jobs, elapsed);
+  for (provision_job* job : pipeline.jobs)
+    done.push_back(job->dev);
+  return 0;
+}
 
-    // sigh
-    void* foo;
-    Wow64DisableWow64FsRedirection(&foo);
+static void print_summary(const std::vector<ms2109_device*>& devices, double elapsed) {
+  fprintf(stderr, "\n%-40s %7s %9s %8s\n", "Device", "Result", "Time (s)", "Reports");
+  for (const ms2109_device* dev : devices)
+    fprintf(stderr, "%-40s %7d %9.3f %8lu\n", dev->label.c_str(), dev->result, dev->seconds, dev->transport->reports);
+  fprintf(stderr, "%u devices in %.3f seconds\n", (unsigned)devices.size(), elapsed);
+}
+
+// p50/p99/max time per command type over everything recorded by trace_command()
+static void print_latency_stats(void) {
+  static const uint8_t cmds[] = { 0xE5, 0xE6, 0xB5, 0xB6 };
+  std::vector<uint32_t> times[4];
+  for (trace_ring* ring : trace_rings) {
+    uint64_t head = ring->head.load(std::memory_order_acquire);
+    for (uint64_t i = head > trace_ring::SIZE ? head - trace_ring::SIZE : 0; i < head; i++) {
+      const trace_event& e = ring->events[i & (trace_ring::SIZE - 1)];
+      for (int c = 0; c < 4; c++) {
+        if (e.cmd == cmds[c]) times[c].push_back(e.duration_ns);
+      }
+    }
+  }
 
-    TCHAR winpath[MAX_PATH + 1];
-    if (GetWindowsDirectory(winpath, MAX_PATH) == 0) {
-      // wtf...
-      _tcscpy_s(winpath, TEXT("C:\\Windows"));
+  BOOLEAN header = false;
+  for (int c = 0; c < 4; c++) {
+    std::vector<uint32_t>& t = times[c];
+    if (t.empty()) continue;
+    if (!header) {
+      fprintf(stderr, "\n%-4s %8s %10s %10s %10s\n", "Cmd", "Count", "p50 (us)", "p99 (us)", "max (us)");
+      header = true;
     }
-    std::basic_string<TCHAR> filename(winpath);
-    filename += TEXT("\\system32\\pnputil.exe");
+    std::sort(t.begin(), t.end());
+    fprintf(stderr, "%02X   %8u %10.1f %10.1f %10.1f\n", cmds[c], (unsigned)t.size(),
+      t[t.size() / 2] / 1000.0, t[std::min(t.size() - 1, t.size() * 99 / 100)] / 1000.0, t.back() / 1000.0);
+  }
+}
 
-    if ((int)ShellExecute(NULL, TEXT("runas"), filename.c_str(), params.c_str(), NULL, SW_SHOWNORMAL) > 32) {
-      fprintf(stderr, "Old USB driver has been uninstalled.\n");
+// writes everything recorded by trace_command() in Chrome's trace event format (chrome://tracing, Perfetto)
+static BOOLEAN write_chrome_trace(const char* filename) {
+  FILE* f = fopen(filename, "w");
+  if (f == NULL) {
+    fprintf(stderr, "Failed to create %s\n", filename);
+    return false;
+  }
+  fprintf(f, "{\"traceEvents\":[\n");
+  const char* sep = "";
+  for (trace_ring* ring : trace_rings) {
+    if (!ring->name.empty()) {
+      // Windows instance IDs are full of backslashes
+      std::string name;
+      for (char c : ring->name) {
+        if (c == '\\' || c == '"') name += '\\';
+        name += c;
+      }
+      fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}", sep, ring->id, name.c_str());
+      sep = ",\n";
+    }
+    uint64_t head = ring->head.load(std::memory_order_acquire);
+    for (uint64_t i = head > trace_ring::SIZE ? head - trace_ring::SIZE : 0; i < head; i++) {
+      const trace_event& e = ring->events[i & (trace_ring::SIZE - 1)];
+      double ts = std::chrono::duration<double, std::micro>(e.start - trace_epoch).count();
+      fprintf(f, "%s{\"name\":\"%02X\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f%s}",
+        sep, e.cmd, ring->id, ts, e.duration_ns / 1000.0, e.ok ? "" : ",\"args\":{\"failed\":true}");
+      sep = ",\n";
     }
-    else fprintf(stderr, "Failed to execute pnputil; you may need to manually uninstall the USB drivers for the MS2109 device\n");
   }
-  free(ms2109_instance);
+  fprintf(f, "\n]}\n");
+  BOOLEAN ok = fclose(f) == 0;
+  if (!ok) fprintf(stderr, "Failed to write %s\n", filename);
+  return ok;
+}
 
-  if (ret==0) fprintf(stderr, "\n\nMake sure to unplug/replug device for the patch to take effect!\n");
+// everything that happens on the way out, whichever mode we were in
+static int finish(int ret, const char* trace_file, BOOLEAN stats) {
+  if (stats)
+    print_latency_stats();
+  if (trace_file && !write_chrome_trace(trace_file) && ret == 0)
+    ret = -1;
   return ret;
 }
+
+static void usage(const char* argv0) {
+  fprintf(stderr, "Usage: %s [options]\n"
+    "  --simulate            patch a simulated MS2109 instead of a real device\n"
+    "  --sim-size <bytes>    simulated EEPROM size, 0x800 (24C16, default) or 0x1000 (24C32)\n"
+    "  --sim-image <file>    load the simulated EEPROM from a dump instead of a generated image\n"
+    "  --sim-latency <us>    simulated time per feature report (default 1000)\n"
+    "  --sim-write-cycle <us> simulated EEPROM write cycle time, writes sent sooner are lost (default 0)\n"
+    "  --sim-fail-after <n>  unplug the simulated device when the n-th EEPROM write comes in\n"
+    "  --sim-save <file>     write the simulated EEPROM to a file when done\n"
+    "  --sim-count <n>       simulate this many devices, all patched at the same time\n"
+    "  --image <file>        patch an EEPROM dump instead of a device\n"
+    "  --out <file>          where to write the patched EEPROM dump\n"
+    "  --flash <file>        make the device's EEPROM match a dump, writing only the bytes that differ\n"
+    "  --no-stats            don't print how long each kind of feature report took when done\n"
+    "  --trace <file>        save the timing of every feature report as a Chrome trace (JSON)\n"
+    "  --cache <file>        where to remember devices between runs (default in the user's cache directory,\n"
+    "                        simulated devices only use one if it's given)\n"
+    "  --no-cache            identify every device from scratch and don't remember them\n"
+    "  --journal <dir>       where to plan EEPROM writes so an interrupted patch can be finished by\n"
+    "                        the next run (default the user's cache directory, simulated devices\n"
+    "                        only use one if it's given)\n"
+    "  --no-journal          write the EEPROM without a journal\n"
+    "  --brightness <n>      set the picture brightness (-128 to 255, default -11), likewise\n"
+    "  --contrast <n>        --contrast (148), --hue (0) and --saturation (180); these only last until\n"
+    "  --hue <n>             the device is unplugged, and nothing gets patched when any are given\n"
+    "  --saturation <n>\n"
+    "  --provision <dir>     back up, patch and verify every MS2109 as it gets plugged in, until Ctrl+C;\n"
+    "                        backups go to dir and can be given to --flash\n"
+    "  --provision-count <n> stop provisioning after this many devices\n"
+    "  --reset-devices <file> <instance>...\n"
+    "                        remove the drivers of these devices so they start afresh when replugged,\n"
+    "                        writing the results to file (- for stdout); done automatically after patching\n"
+    "  --monitor             keep watching the HDMI input of every device, publishing it in shared memory\n"
+    "  --monitor-interval <ms> back off to polling this often once the input is stable, so changes\n"
+    "                        can take this long to show (default: once a frame, never backing off)\n"
+    "  --monitor-seconds <n> stop monitoring after this long instead of waiting for Ctrl+C\n"
+    "  --monitor-read        print what a running --monitor is publishing\n"
+    "  --legacy-writes       verify every EEPROM byte straight after writing it\n"
+    "  --bench-patch         patch two simulated devices with per-byte and batched writes and compare\n"
+    "                        (with a 3000us write cycle unless --sim-write-cycle is given)\n"
+    "  --bench-read          compare word-by-word and bulk EEPROM reads instead of patching\n"
+    "  --bench-suite         time identify, EEPROM read, patch, checksum verify and telemetry polling on\n"
+    "                        simulated 0x800 and 0x1000 byte EEPROMs, one JSON line per result on stdout\n"
+    "  --bench-runs <n>      how many times --bench-suite runs each benchmark (default 3)\n"
+    "  --test-journal        interrupt a simulated patch at every EEPROM write and check it can be finished\n"
+    "  --bench-async         read every device's EEPROM one at a time and then all at once\n"
+#ifdef __linux__
+    "  --uhid                expose the simulated device through /dev/uhid and patch it via hidraw\n"
+#endif
+    , argv0);
+}
+
+int main(int argc, char* argv[])
+{
+  BOOLEAN simulate = false;
+  uint16_t sim_size = 0x800;
+  unsigned sim_latency = 1000;
+  unsigned sim_write_cycle = 0;
+  BOOLEAN sim_write_cycle_set = false;
+  unsigned sim_fail_after = 0;
+  const char* sim_image = NULL;
+  const char* sim_save = NULL;
+  BOOLEAN use_uhid = false;
+  BOOLEAN bench_read = false;
+  BOOLEAN bench_patch = false;
+  BOOLEAN bench_async = false;
+  BOOLEAN bench_suite = false;
+  unsigned bench_runs = 3;
+  const char* image_in = NULL;
+  const char* image_out = NULL;
+  const char* flash_file = NULL;
+  BOOLEAN legacy_writes = false;
+  unsigned sim_count = 1;
+  const char* trace_file = NULL;
+  BOOLEAN show_stats = true;
+  const char* cache_file = NULL;
+  BOOLEAN monitor = false;
+  color_settings colors = {};
+  BOOLEAN set_colors = false;
+  unsigned monitor_interval = 0;
+  unsigned monitor_seconds = 0;
+  BOOLEAN no_cache = false;
+  const char* journal_dir = NULL;
+  const char* provision_dir = NULL;
+  unsigned provision_count = 0;
+  BOOLEAN no_journal = false;
+  BOOLEAN journal_test = false;
+
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    const char* val = i + 1 < argc ? argv[i + 1] : NULL;
+    if (!strcmp(arg, "--simulate")) simulate = true;
+    else if (!strcmp(arg, "--sim-size") && val) sim_size = (uint16_t)strtoul(argv[++i], NULL, 0), simulate = true;
+    else if (!strcmp(arg, "--sim-image") && val) sim_image = argv[++i], simulate = true;
+    else if (!strcmp(arg, "--sim-latency") && val) sim_latency = strtoul(argv[++i], NULL, 0), simulate = true;
+    else if (!strcmp(arg, "--sim-write-cycle") && val) sim_write_cycle = strtoul(argv[++i], NULL, 0), sim_write_cycle_set = true, simulate = true;
+    else if (!strcmp(arg, "--sim-fail-after") && val) sim_fail_after = strtoul(argv[++i], NULL, 0), simulate = true;
+    else if (!strcmp(arg, "--sim-save") && val) sim_save = argv[++i], simulate = true;
+    else if (!strcmp(arg, "--bench-read")) bench_read = true;
+    else if (!strcmp(arg, "--bench-async")) bench_async = true;
+    else if (!strcmp(arg, "--bench-suite")) bench_suite = true, simulate = true;
+    else if (!strcmp(arg, "--bench-runs") && val) bench_runs = strtoul(argv[++i], NULL, 0), bench_suite = true, simulate = true;
+    else if (!strcmp(arg, "--image") && val) image_in = argv[++i];
+    else if (!strcmp(arg, "--out") && val) image_out = argv[++i];
+    else if (!strcmp(arg, "--flash") && val) flash_file = argv[++i];
+    else if (!strcmp(arg, "--bench-patch")) bench_patch = true, simulate = true;
+    else if (!strcmp(arg, "--trace") && val) trace_file = argv[++i];
+    else if (!strcmp(arg, "--no-stats")) show_stats = false;
+    else if (!strcmp(arg, "--legacy-writes")) legacy_writes = true;
+    else if (!strcmp(arg, "--cache") && val) cache_file = argv[++i];
+    else if (!strcmp(arg, "--no-cache")) no_cache = true;
+    else if (!strcmp(arg, "--journal") && val) journal_dir = argv[++i];
+    else if (!strcmp(arg, "--no-journal")) no_journal = true;
+    else if (!strcmp(arg, "--reset-devices") && val) return reset_worker(argv[i + 1], argc - i - 2, argv + i + 2);
+    else if (!strcmp(arg, "--provision") && val) provision_dir = argv[++i];
+    else if (!strcmp(arg, "--provision-count") && val) provision_count = strtoul(argv[++i], NULL, 0);
+    else if (!strcmp(arg, "--test-journal")) journal_test = true, simulate = true;
+    else if (!strcmp(arg, "--monitor")) monitor = true;
+    else if (!strncmp(arg, "--", 2) && find_color_control(arg + 2) >= 0 && val) {
+      int c = find_color_control(arg + 2);
+      long v = strtol(argv[++i], NULL, 0);
+      if (v < -128 || v > 255) {
+        fprintf(stderr, "%s must be between -128 and 255\n", arg);
+        return -1;
+      }
+      colors.value[c] = (int16_t)v;
+      colors.set[c] = true;
+      set_colors = true;
+    }
+    else if (!strcmp(arg, "--monitor-interval") && val) monitor_interval = strtoul(argv[++i], NULL, 0), monitor = true;
+    else if (!strcmp(arg, "--monitor-seconds") && val) monitor_seconds = strtoul(argv[++i], NULL, 0), monitor = true;
+    else if (!strcmp(arg, "--monitor-read")) return print_monitor();
+    else if (!strcmp(arg, "--sim-count") && val) sim_count = strtoul(argv[++i], NULL, 0), simulate = true;
+#ifdef __linux__
+    else if (!strcmp(arg, "--uhid")) use_uhid = true, simulate = true;
+#endif
+    else {
+      usage(argv[0]);
+      return -1;
+    }
+  }
+
+  if (use_uhid && sim_count > 1) {
+    fprintf(stderr, "--uhid only works with a single simulated device\n");
+    return -1;
+  }
+
+  if (image_in)
+    return finish(patch_image(image_in, image_out), trace_file, show_stats);
+
+  std::vector<uint8_t> flash_target;
+  if (flash_file && !load_image(flash_file, flash_target))
+    return -1;
+
+  std::vector<ms2109_simulator*> sims;
+  if (simulate) {
+    std::vector<uint8_t> image;
+    if (sim_image) {
+      if (!load_image(sim_image, image))
+        return -1;
+    }
+    else if (sim_size == 0x800 || sim_size == 0x1000)
+      image = make_sim_image(sim_size);
+    else {
+      fprintf(stderr, "Unsupported simulated EEPROM size %X\n", sim_size);
+      return -1;
+    }
+    fprintf(stderr, "MS2109 firmware patcher, using simulated device (%u byte EEPROM, %uus per report)\n", (unsigned)image.size(), sim_latency);
+    if (bench_patch)
+      // a typical 24Cxx write cycle, otherwise the pacing that batched writes need costs nothing
+      return finish(benchmark_patch(image, sim_latency, sim_write_cycle_set ? sim_write_cycle : 3000), trace_file, show_stats);
+    if (bench_suite)
+      return finish(benchmark_suite(sim_latency, sim_write_cycle, bench_runs), trace_file, show_stats);
+    if (journal_test) {
+      std::string dir = journal_dir ? journal_dir : default_temp_dir();
+      if (!dir.empty() && dir.back() != '/' && dir.back() != '\\') dir += '/';
+      return finish(test_journal(image, device_file_name(dir.c_str(), "SIM\\test", ".journal")), trace_file, show_stats);
+    }
+    for (unsigned i = 0; i < sim_count; i++) {
+      sims.push_back(new ms2109_simulator(image, sim_latency, sim_write_cycle));
+      sims.back()->fail_after_writes = sim_fail_after;
+    }
+  }
+
+  std::vector<ms2109_device*> devices;
+#ifdef __linux__
+  uhid_device* uhid = NULL;
+  if (use_uhid) {
+    uhid = new uhid_device(*sims[0]);
+    if (!uhid->start()) {
+      delete uhid;
+      delete sims[0];
+      return -100;
+    }
+    // the hidraw node shows up asynchronously
+    for (int tries = 0; devices.empty() && tries < 40; tries++) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      ms2109_device* dev = uhid->open_hidraw();
+      if (dev) devices.push_back(dev);
+    }
+  }
+  else
+#endif
+  // when provisioning, devices get picked up as they're plugged in instead
+  if (simulate && !provision_dir) {
+    for (unsigned i = 0; i < sims.size(); i++) {
+      ms2109_device* dev = new ms2109_device;
+      dev->transport = sims[i];
+      dev->label = "sim" + std::to_string(i);
+      devices.push_back(dev);
+    }
+  }
+  else if (!provision_dir) {
+    fprintf(stderr, "MS2109 firmware patcher, searching for devices...\n");
+#if defined(_WIN32) || defined(__linux__)
+    find_devices(devices);
+#endif
+  }
+  if (devices.empty() && !provision_dir) {
+    fprintf(stderr, "Failed to find MS2109 device\n");
+#ifdef __linux__
+    delete uhid; // stops its worker thread, which uses the simulator
+#endif
+    for (ms2109_simulator* sim : sims) delete sim;
+    return -100;
+  }
+
+  for (size_t i = 0; i < devices.size(); i++) {
+    ms2109_device* dev = devices[i];
+    dev->verify_each_write = legacy_writes;
+    // only worth labelling messages when they could come from more than one device
+    if (devices.size() == 1)
+      dev->label.clear();
+    else if (dev->label.empty())
+      dev->label = dev->instance ? narrow(dev->instance) : "device" + std::to_string(i);
+  }
+
+  // simulated devices start out fresh every run, so they'd only confuse a cache that isn't asked for
+  std::string cache_path = cache_file ? cache_file : simulate ? "" : default_cache_file();
+  if (no_cache) cache_path.clear();
+  fingerprint_cache cache;
+  if (!cache_path.empty()) cache.load(cache_path.c_str());
+
+  for (size_t i = 0; i < sims.size() && i < devices.size(); i++) {
+    // give simulated devices instance IDs so the cache has something to go on
+    if (!devices[i]->instance)
+      set_sim_instance(*devices[i], i);
+  }
+
+  // like the cache, simulated devices only get journals when asked for
+  std::string journal_path = journal_dir ? journal_dir : simulate ? "" : default_cache_dir();
+  if (!journal_path.empty() && journal_path.back() != '/' && journal_path.back() != '\\') journal_path += '/';
+  for (ms2109_device* dev : devices) {
+    if (!no_journal && !journal_path.empty() && dev->instance)
+      dev->journal_file = device_file_name(journal_path.c_str(), narrow(dev->instance), ".journal");
+  }
+
+  if (bench_async) {
+    int ret = benchmark_async(devices);
+    for (ms2109_device* dev : devices) delete dev;
+    return finish(ret, trace_file, show_stats);
+  }
+
+  monitor_shm* shm = NULL;
+  std::thread monitor_timer;
+  if (monitor) {
+    if ((shm = open_monitor_shm(true)) == NULL) {
+      fprintf(stderr, "Failed to create the monitor's shared memory\n");
+      for (ms2109_device* dev : devices) delete dev;
+      return -1;
+    }
+    shm->slot_count = 0;
+    for (size_t i = 0; i < devices.size() && i < MONITOR_SLOTS; i++) {
+      std::string name = devices[i]->instance ? narrow(devices[i]->instance) : "device" + std::to_string(i);
+      snprintf(shm->slots[i].instance, sizeof(shm->slots[i].instance), "%s", name.c_str());
+      publish_slot(shm->slots[i], signal_state(), false, 0, 0);
+      shm->slot_count = (uint32_t)i + 1;
+    }
+    shm->magic = MONITOR_MAGIC;
+    signal(SIGINT, stop_monitor);
+    signal(SIGTERM, stop_monitor);
+    if (monitor_seconds) {
+      monitor_timer = std::thread([monitor_seconds] {
+        auto until = trace_clock::now() + std::chrono::seconds(monitor_seconds);
+        while (!monitor_stop && trace_clock::now() < until)
+          std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        monitor_stop = true;
+      });
+    }
+    fprintf(stderr, "Monitoring %u device(s), press Ctrl+C to stop\n", shm->slot_count);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  int provision_ret = 0;
+  if (provision_dir) {
+    std::string dir = provision_dir;
+    if (!dir.empty() && dir.back() != '/' && dir.back() != '\\') dir += '/';
+    provision_ret = provision(dir, sims, provision_count, [&](ms2109_device& dev) {
+      dev.verify_each_write = legacy_writes;
+      if (!no_journal && !journal_path.empty() && dev.instance)
+        dev.journal_file = device_file_name(journal_path.c_str(), narrow(dev.instance), ".journal");
+    }, devices);
+  }
+  else run_on_all(devices, [&](ms2109_device& dev) {
+    if (monitor) {
+      size_t slot = std::find(devices.begin(), devices.end(), &dev) - devices.begin();
+      return slot < MONITOR_SLOTS ? monitor_device(dev, shm->slots[slot], monitor_interval) : 0;
+    }
+    if (set_colors) return apply_color_settings(dev, colors);
+    if (bench_read) return benchmark_read(dev);
+    if (flash_file) return flash_device(dev, flash_target);
+    const device_fingerprint* cached = NULL;
+    if (!cache_path.empty() && dev.instance)
+      cached = cache.find(narrow(dev.instance));
+    return patch_device(dev, cached);
+  });
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  if (shm) {
+    if (monitor_timer.joinable()) monitor_timer.join();
+    for (ms2109_device* dev : devices)
+      fprintf(stderr, "%s: %lu feature reports in %.1f seconds (%.1f per second)\n", dev->label.empty() ? "Device" : dev->label.c_str(),
+        dev->transport->reports, elapsed, dev->transport->reports / elapsed);
+    shm->magic = 0;
+    close_monitor_shm(shm, true);
+    int ret = 0;
+    for (ms2109_device* dev : devices) {
+      if (ret == 0) ret = dev->result;
+      delete dev;
+    }
+    return finish(ret, trace_file, show_stats);
+  }
+
+  int ret = provision_ret;
+  BOOLEAN any_done = false;
+  for (ms2109_device* dev : devices) {
+    if (ret == 0) ret = dev->result;
+    if (dev->result == 0) any_done = true;
+  }
+  if (!cache_path.empty()) {
+    BOOLEAN changed = false;
+    for (ms2109_device* dev : devices) {
+      if (!dev->instance) continue;
+      // --flash could have changed anything
+      if (flash_file || dev->fingerprint_stale) cache.forget(narrow(dev->instance)), changed = true;
+      else if (dev->fingerprint_valid) cache.update(narrow(dev->instance), dev->fingerprint), changed = true;
+    }
+    if (changed) {
+      make_parent_dirs(cache_path);
+      cache.save(cache_path.c_str());
+    }
+  }
+
+  if (devices.size() > 1 && !provision_dir)
+    print_summary(devices, elapsed);
+  else if (simulate && devices.size() == 1)
+    fprintf(stderr, "Simulated device: %lu feature reports in %.3f seconds\n", devices[0]->transport->reports, elapsed);
+
+  for (size_t i = 0; sim_save && i < sims.size(); i++) {
+    std::string filename = sim_save;
+    if (sims.size() > 1) filename += "." + std::to_string(i);
+    if (!save_file(filename.c_str(), sims[i]->eeprom.data(), sims[i]->eeprom.size()) && ret == 0)
+      ret = -1;
+  }
+
+  std::vector<ms2109_device*> patched;
+  for (ms2109_device* dev : devices) {
+    if (dev->result == 0 && dev->instance && !simulate && !set_colors && !bench_read)
+      patched.push_back(dev);
+  }
+  if (!patched.empty())
+    reset_devices(patched);
+
+#ifdef __linux__
+  if (uhid) {
+    for (ms2109_device* dev : devices) delete dev;
+    delete uhid;
+    delete sims[0];
+  }
+  else
+#endif
+  for (ms2109_device* dev : devices) delete dev;
+
+  if (any_done && !simulate && !set_colors) fprintf(stderr, "\n\nMake sure to unplug/replug device for the patch to take effect!\n");
+  return finish(ret, trace_file, show_stats);
+}